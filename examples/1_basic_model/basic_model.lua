@@ -50,8 +50,11 @@ Data.load_state("nucleotide", Config.get_str("MODEL.sequences_file"))
 
 -- To create the single free parameter, the Parameter.new function is called, this has three arguments:
 --   - name - STRING - specifies the name of the parameter, which will be used in the output files.
---   - type - STRING - specifies the type of the parameter, either 'continuous', discrete', 'fixed' or 'virtual'.
+--   - type - STRING - specifies the type of the parameter, either 'continuous', 'continuous_slice', discrete', 'fixed' or 'virtual'.
 --   - options - TABLE - specifies the unique options for each parameter type.
+-- A 'continuous_slice' parameter takes the same options as 'continuous', but is updated by slice sampling rather than a random
+-- walk, so it is never rejected. Its step_size is the width of the steps taken to find the slice, at most max_steps of them
+-- (optional, default 10).
 
 x = Parameter.new("x", "continuous", {initial_value = 0.001, step_size = Config.get_float("MODEL.step_size"), lower_bound = 0.0})
 
@@ -0,0 +1,203 @@
+#include "AdaptiveSchedule.h"
+
+#include "Environment.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <set>
+#include <utility>
+
+extern Environment env;
+
+AdaptiveSchedule::AdaptiveSchedule(Model* model) : model(model) {
+  active = env.get_or<bool>("MCMC.adaptive_schedule", false);
+  current = -1;
+
+  parameter_steps = 0;
+  parameter_time = 0.0;
+  alignment_steps = 0;
+  sum_w = sum_ww = sum_t = sum_wt = 0.0;
+
+  if(not active) return;
+
+  if(model->alignment_count() == 0) {
+    std::cout << "Warning: no alignments are sampled, the adaptive schedule is not used." << std::endl;
+    active = false;
+    return;
+  }
+
+  unsigned long burn_in = env.get<int>("MCMC.burn_in");
+  unsigned int freq = env.get<int>("MCMC.alignment_sample_frequency");
+  n_sample = env.get<unsigned int>("MCMC.position_sample_count");
+  unsigned int n_cols = model->alignment_column_count();
+
+  /*
+   * Candidates are the configured frequency and window, halved and doubled.
+   * Blocks are long enough for the least frequent candidate to update the alignments a few times.
+   */
+  std::set<std::pair<unsigned int, unsigned int>> seen = {};
+  unsigned int max_freq = 0;
+  for(unsigned int f : {freq / 2, freq, freq * 2}) {
+    f = std::max(f, 2u);
+    for(unsigned int w : {n_sample / 2, n_sample, n_sample * 2}) {
+      w = std::min(std::max(w, 1u), n_cols);
+      if(seen.insert({f, w}).second) {
+	candidates.push_back({f, w, 0.0, 0});
+	max_freq = std::max(max_freq, f);
+      }
+    }
+  }
+
+  block_length = 4 * (unsigned long)max_freq;
+  batch = std::max(1ul, (unsigned long)std::sqrt((double)block_length));
+  trial_start = burn_in / 2;
+
+  unsigned long round_length = block_length * candidates.size();
+  unsigned long rounds = (burn_in - trial_start) / round_length;
+  if(rounds == 0) {
+    std::cout << "Warning: burn in is too short for the adaptive schedule, it needs at least " << 2 * round_length
+	      << " generations. Keeping the configured schedule." << std::endl;
+    active = false;
+    return;
+  }
+  trial_end = trial_start + rounds * round_length;
+
+  std::cout << "\tAdaptive schedule: " << candidates.size() << " candidates in blocks of " << block_length
+	    << " generations, fixed from generation " << trial_end << "." << std::endl;
+}
+
+bool AdaptiveSchedule::activep() {
+  return(active);
+}
+
+void AdaptiveSchedule::record(unsigned long gen, bool alignmentp, double seconds, double lnL) {
+  if(not active) return;
+
+  if(alignmentp) {
+    double w = n_sample;
+    alignment_steps++;
+    sum_w += w;
+    sum_ww += w * w;
+    sum_t += seconds;
+    sum_wt += w * seconds;
+  } else {
+    parameter_steps++;
+    parameter_time += seconds;
+  }
+
+  if(gen < trial_start) return;
+
+  if(current == -1) {
+    start_block(0);
+    return;
+  }
+
+  add_to_block(lnL);
+  if(block_n < block_length) return;
+
+  end_block();
+  if(gen >= trial_end) {
+    freeze();
+  } else {
+    start_block((current + 1) % candidates.size());
+  }
+}
+
+void AdaptiveSchedule::start_block(unsigned int candidate) {
+  current = candidate;
+  n_sample = candidates[current].n_sample;
+  model->set_alignment_schedule(candidates[current].freq, n_sample);
+
+  block_n = 0;
+  shift = 0.0;
+  batch_sum = batch_sum_sq = 0.0;
+  sum = sum_sq = 0.0;
+  means_sum = means_sum_sq = 0.0;
+}
+
+void AdaptiveSchedule::add_to_block(double lnL) {
+  if(block_n == 0) shift = lnL;
+  block_n++;
+
+  double x = lnL - shift;
+  batch_sum += x;
+  batch_sum_sq += x * x;
+  if(block_n % batch != 0) return;
+
+  sum += batch_sum;
+  sum_sq += batch_sum_sq;
+  double batch_mean = batch_sum / batch;
+  means_sum += batch_mean;
+  means_sum_sq += batch_mean * batch_mean;
+  batch_sum = batch_sum_sq = 0.0;
+}
+
+void AdaptiveSchedule::end_block() {
+  candidates[current].ess += block_ess();
+  candidates[current].gens += block_n;
+}
+
+double AdaptiveSchedule::block_ess() {
+  /*
+   * Effective sample size of the log likelihood over the block, from the variance of batch means.
+   */
+  unsigned long n_batches = block_n / batch;
+  if(n_batches < 2) return(0.0);
+  unsigned long n = n_batches * batch;
+
+  double mean = sum / n;
+  double var = (sum_sq - n * mean * mean) / (n - 1);
+  if(var <= 0.0) return(0.0); // Stuck.
+
+  // The batch means average to the overall mean.
+  double batch_var = (means_sum_sq - n_batches * mean * mean) / (n_batches - 1);
+  if(batch_var <= 0.0) return(n);
+
+  return(std::min((double)n, n * var / (batch * batch_var)));
+}
+
+void AdaptiveSchedule::freeze() {
+  /*
+   * Picks the candidate with the most effective samples per second, with the cost of a generation predicted from the
+   * measured costs of each kind of step. An alignment step costs a fixed amount plus an amount per position.
+   */
+  double parameter_cost = parameter_steps > 0 ? parameter_time / parameter_steps : 0.0;
+
+  double fixed_cost = alignment_steps > 0 ? sum_t / alignment_steps : 0.0;
+  double position_cost = 0.0;
+  double denominator = alignment_steps * sum_ww - sum_w * sum_w;
+  if(alignment_steps >= 2 and denominator > 0.0) {
+    double slope = (alignment_steps * sum_wt - sum_w * sum_t) / denominator;
+    if(slope >= 0.0) {
+      position_cost = slope;
+      fixed_cost = (sum_t - slope * sum_w) / alignment_steps;
+    }
+  }
+
+  int best = -1;
+  double best_rate = 0.0;
+  for(unsigned int c = 0; c < candidates.size(); c++) {
+    const Candidate& candidate = candidates[c];
+    if(candidate.gens == 0) continue;
+
+    double alignment_share = std::min(1.0, (double)model->alignment_count() / candidate.freq);
+    double cost = alignment_share * (fixed_cost + position_cost * candidate.n_sample) + (1.0 - alignment_share) * parameter_cost;
+    double rate = candidate.ess / candidate.gens;
+    if(cost > 0.0) rate /= cost;
+
+    if(best == -1 or rate > best_rate) {
+      best = c;
+      best_rate = rate;
+    }
+  }
+
+  n_sample = candidates[best].n_sample;
+  model->set_alignment_schedule(candidates[best].freq, n_sample);
+  active = false;
+
+  std::cout << "Adaptive schedule fixed: alignment_sample_frequency " << candidates[best].freq
+	    << ", position_sample_count " << candidates[best].n_sample << "." << std::endl;
+  std::cout << "\tAlignment step " << fixed_cost << "s + " << position_cost << "s per position, parameter step "
+	    << parameter_cost << "s." << std::endl;
+}
@@ -0,0 +1,61 @@
+/*
+ * Tunes how often the alignments are resampled, and how many positions each time, during the burn in.
+ * Candidate schedules are run in turn over the second half of the burn in, the one with the most effective samples
+ * of the log likelihood per second is kept for the rest of the chain.
+ */
+
+#ifndef AdaptiveSchedule_h_
+#define AdaptiveSchedule_h_
+
+#include <vector>
+
+#include "Model.h"
+
+class AdaptiveSchedule {
+public:
+  AdaptiveSchedule(Model* model);
+
+  bool activep();
+  void record(unsigned long gen, bool alignmentp, double seconds, double lnL); // After every generation.
+private:
+  Model* model;
+  bool active;
+
+  struct Candidate {
+    unsigned int freq; // Alignment sample frequency.
+    unsigned int n_sample; // Position sample count.
+    double ess; // Effective samples over its blocks.
+    unsigned long gens; // Generations over its blocks.
+  };
+  std::vector<Candidate> candidates;
+
+  // Trials run in blocks, cycling through the candidates.
+  unsigned long trial_start;
+  unsigned long trial_end;
+  unsigned long block_length;
+  int current; // Candidate of the current block, -1 before the trials.
+
+  // Running sums of the log likelihood over the current block, taken relative to its first value for precision.
+  // Only whole batches are counted.
+  unsigned long batch; // Generations per batch.
+  unsigned long block_n; // Generations recorded in the block.
+  double shift;
+  double batch_sum, batch_sum_sq; // Current batch.
+  double sum, sum_sq; // Generations in whole batches.
+  double means_sum, means_sum_sq; // Batch means.
+
+  void start_block(unsigned int candidate);
+  void add_to_block(double lnL);
+  void end_block();
+  double block_ess();
+  void freeze();
+
+  // Costs in seconds.
+  unsigned int n_sample; // Current window.
+  unsigned long parameter_steps;
+  double parameter_time;
+  unsigned long alignment_steps; // Alignment step times are fitted against the window size.
+  double sum_w, sum_ww, sum_t, sum_wt;
+};
+
+#endif
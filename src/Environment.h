@@ -25,6 +25,9 @@ public:
   template<typename T>
   T get(std::string);
 
+  template<typename T>
+  T get_or(std::string, T default_value); // For options that do not need to be set.
+
   template<typename T>
   std::vector<T> get_array(std::string);
 
@@ -45,6 +48,16 @@ T Environment::get(std::string option) {
   }
 }
 
+template<typename T>
+T Environment::get_or(std::string option, T default_value) {
+  auto val = config->get_qualified_as<T>(option);
+  if(val) {
+    return(*val);
+  } else {
+    return(default_value);
+  }
+}
+
 template<typename T>
 std::vector<T> Environment::get_array(std::string option) {
  std::vector<T> ret = {};
@@ -54,7 +54,7 @@ namespace IO {
   }
   
   void ParameterWrapper::set_lower_bound(ParameterWrapper* param) {
-    if(this->get_type() != "CONTINUOUS_FLOAT") {
+    if(dynamic_cast<ContinuousFloat*>(this->parameter) == nullptr) {
       std::cerr << "Error: setting the lower bound for parameter not of type CONTINUOUS_FLOAT." << std::endl;
       exit(EXIT_FAILURE);
     }
@@ -71,7 +71,7 @@ namespace IO {
   }
 
   void ParameterWrapper::set_upper_bound(ParameterWrapper* param) {
-    if(this->get_type() != "CONTINUOUS_FLOAT") {
+    if(dynamic_cast<ContinuousFloat*>(this->parameter) == nullptr) {
       std::cerr << "Error: setting the upper bound for parameter not of type CONTINUOUS_FLOAT." << std::endl;
       exit(EXIT_FAILURE);
     }
@@ -89,14 +89,10 @@ namespace IO {
 
 
   // Creating parameters.
-  ContinuousFloat* new_ContinuousFloat(std::string name, sol::table tbl) {
-    double init = value_from_table<double>(tbl, "initial_value");
-    double step_size = value_from_table<double>(tbl, "step_size");
+  static void set_fixed_bounds(ContinuousFloat* parameter, sol::table tbl) {
     double lower_bound = tbl.get_or<double>("lower_bound", neg_inf);
     double upper_bound = tbl.get_or<double>("upper_bound", inf);
 
-    ContinuousFloat* parameter = new ContinuousFloat(name, init, step_size);
-
     if(lower_bound != neg_inf) {
       parameter->set_lower_boundary(new FixedConstraint(lower_bound));
     }
@@ -104,6 +100,30 @@ namespace IO {
     if(upper_bound != inf) {
       parameter->set_upper_boundary(new FixedConstraint(upper_bound));
     }
+  }
+
+  ContinuousFloat* new_ContinuousFloat(std::string name, sol::table tbl) {
+    double init = value_from_table<double>(tbl, "initial_value");
+    double step_size = value_from_table<double>(tbl, "step_size");
+
+    ContinuousFloat* parameter = new ContinuousFloat(name, init, step_size);
+    set_fixed_bounds(parameter, tbl);
+
+    return(parameter);
+  }
+
+  ContinuousSlice* new_ContinuousSlice(std::string name, sol::table tbl) {
+    double init = value_from_table<double>(tbl, "initial_value");
+    double step_size = value_from_table<double>(tbl, "step_size");
+    sol::optional<int> opt_max_steps = tbl["max_steps"];
+    int max_steps = opt_max_steps ? opt_max_steps.value() : 10;
+    if(max_steps < 1) {
+      std::cerr << "Error: max_steps of parameter \'" << name << "\' must be at least 1." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    ContinuousSlice* parameter = new ContinuousSlice(name, init, step_size, max_steps);
+    set_fixed_bounds(parameter, tbl);
 
     return(parameter);
   }
@@ -127,6 +147,8 @@ namespace IO {
     AbstractComponent* param = nullptr;
     if(parameter_type == "continuous") {
       param = new_ContinuousFloat(name, tbl);
+    } else if(parameter_type == "continuous_slice") {
+      param = new_ContinuousSlice(name, tbl);
     } else if(parameter_type == "discrete") {
       param = new_DiscreteFloat(name, tbl);
     } else if(parameter_type == "fixed") {
@@ -1,4 +1,5 @@
 #include <sstream>
+#include <chrono>
 
 #include "MCMC.h"
 
@@ -13,6 +14,7 @@ extern IO::Files files;
 
 MCMC::MCMC() {
   model = 0;
+  schedule = 0;
   gen = 0;
   gens = 0;
   lnL = 0;
@@ -33,6 +35,8 @@ void MCMC::Initialize(Model* model) {
   print_freq = env.get<int>("MCMC.print_frequency");
   complete_likelihood_update = env.get<int>("MCMC.full_update_freq");
 
+  schedule = new AdaptiveSchedule(model);
+
   //Calculate initial likelihood.
   lnL = model->CalculateLikelihood();
 
@@ -47,6 +51,10 @@ void MCMC::Initialize(Model* model) {
 }
 
 void MCMC::sample() {
+  // Timed while the schedule is being tuned.
+  bool alignmentp = schedule->activep() and model->sampling_alignmentp();
+  auto start = std::chrono::steady_clock::now();
+
   sample_status s = model->sample();
 
   static int gens_since_complete = complete_likelihood_update;
@@ -69,7 +77,7 @@ void MCMC::sample() {
   if(s.testp) {
     //Metropolis-Hasting method.
     float r = Random();
-    if (log(r) <= (newLnL - lnL)) {
+    if (log(r) <= (newLnL - lnL) + s.log_hastings) {
       lnL = newLnL;
       model->accept();
     } else {
@@ -81,6 +89,11 @@ void MCMC::sample() {
     lnL = newLnL;
     model->accept();
   }
+
+  if(schedule->activep()) {
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    schedule->record((unsigned long)gen, alignmentp, seconds.count(), lnL);
+  }
 }
 
 void MCMC::Run() {
@@ -2,6 +2,7 @@
 #define MCMC_h_
 
 #include "Model.h"
+#include "AdaptiveSchedule.h"
 
 #include <boost/multiprecision/cpp_int.hpp> 
 
@@ -10,6 +11,7 @@ using boost::multiprecision::uint128_t;
 class MCMC {
 private:
   Model* model;
+  AdaptiveSchedule* schedule;
   uint128_t gen;
   double lnL;
   double newLnL;
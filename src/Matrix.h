@@ -3,13 +3,59 @@
 
 #include <cstdlib> // For exit()
 #include <iostream> // For cerr
+#include <algorithm>
+#include <new>
 #include <vector>
 
 using std::vector;
 
+/**
+ * Allocator giving storage aligned to a cache line, so rows of doubles can be loaded
+ * with full width vector instructions.
+ */
+template<typename DataType, size_t Alignment = 64>
+struct AlignedAllocator {
+	typedef DataType value_type;
+
+	template<typename Other>
+	struct rebind {
+		typedef AlignedAllocator<Other, Alignment> other;
+	};
+
+	AlignedAllocator() {
+	}
+
+	template<typename Other>
+	AlignedAllocator(const AlignedAllocator<Other, Alignment>&) {
+	}
+
+	DataType* allocate(size_t n) {
+		void* p = ::operator new(n * sizeof(DataType), std::align_val_t(Alignment));
+		return static_cast<DataType*>(p);
+	}
+
+	void deallocate(DataType* p, size_t) {
+		::operator delete(p, std::align_val_t(Alignment));
+	}
+
+	template<typename Other>
+	bool operator==(const AlignedAllocator<Other, Alignment>&) const {
+		return true;
+	}
+
+	template<typename Other>
+	bool operator!=(const AlignedAllocator<Other, Alignment>&) const {
+		return false;
+	}
+};
+
+/**
+ * Row major matrix held in one aligned block of memory.
+ * Row i starts at data() + i * number_of_columns.
+ */
 template<typename DataType>
 class Matrix {
-	typedef vector<DataType> RowType;
+	typedef vector<DataType, AlignedAllocator<DataType>> StorageType;
 
 public:
 	size_t number_of_rows;
@@ -40,11 +86,14 @@ public:
 	void resize(size_t inRows, size_t inColumns, const DataType& inVal =
 			DataType());
 
-	const RowType& operator[](size_t index) const;
-	RowType& operator[](size_t index);
+	const DataType* operator[](size_t index) const;
+	DataType* operator[](size_t index);
+
+	const DataType* data() const;
+	DataType* data();
 
 	DataType& at(size_t row_index, size_t column_index);
-	DataType& at(size_t row_index, size_t column_index) const;
+	const DataType& at(size_t row_index, size_t column_index) const;
 
 	const Matrix& operator+(const Matrix& matrix);
 	const Matrix& operator+=(const Matrix& matrix);
@@ -54,9 +103,10 @@ public:
 
 	void swap(Matrix& matrix);
 	void symmetrize();
+	void transpose_to(Matrix& matrix) const;
 
 private:
-	vector<RowType> rows;
+	StorageType elements;
 };
 
 /**
@@ -85,46 +135,54 @@ Matrix<DataType>::Matrix(size_t number_of_rows, size_t number_of_columns,
 template<typename DataType>
 Matrix<DataType>::Matrix(const Matrix& matrix) :
 		number_of_rows(matrix.number_of_rows), number_of_columns(
-				matrix.number_of_columns), rows(matrix.rows) {
+				matrix.number_of_columns), elements(matrix.elements) {
 }
 
 template<typename DataType>
 void Matrix<DataType>::fill(const DataType& value) {
-	for (size_t row = 0; row < number_of_rows; row++) {
-		for (size_t column = 0; column < number_of_columns; column++)
-			rows[row][column] = value;
-	}
+	std::fill(elements.begin(), elements.end(), value);
 }
 
 template<typename DataType>
 void Matrix<DataType>::clear() {
-	for (size_t row = 0; row < number_of_rows; ++row)
-		rows[row].clear();
+	elements.clear();
 
 	number_of_rows = 0;
 	number_of_columns = 0;
 }
 
+/**
+ * Existing elements are not kept in place if the number of columns changes,
+ * only the storage is reused.
+ */
 template<typename DataType>
 void Matrix<DataType>::resize(size_t number_of_rows, size_t number_of_columns,
 		const DataType& inVal) {
 	this->number_of_rows = number_of_rows;
 	this->number_of_columns = number_of_columns;
-	rows.resize(number_of_rows);
-	for (size_t row = 0; row < number_of_rows; row++)
-		rows[row].resize(number_of_columns, inVal);
+	elements.resize(number_of_rows * number_of_columns, inVal);
 }
 
 template<typename DataType>
-inline const typename Matrix<DataType>::RowType&
+inline const DataType*
 Matrix<DataType>::operator[](size_t index) const {
-	return rows[index];
+	return elements.data() + index * number_of_columns;
 }
 
 template<typename DataType>
-inline typename Matrix<DataType>::RowType&
+inline DataType*
 Matrix<DataType>::operator[](size_t index) {
-	return rows[index];
+	return elements.data() + index * number_of_columns;
+}
+
+template<typename DataType>
+inline const DataType* Matrix<DataType>::data() const {
+	return elements.data();
+}
+
+template<typename DataType>
+inline DataType* Matrix<DataType>::data() {
+	return elements.data();
 }
 
 template<typename DataType>
@@ -134,17 +192,17 @@ Matrix<DataType>::at(size_t row_index, size_t column_index) {
 		std::cerr << "ERROR! Matrix bounds exceeded" << std::endl;
 		exit(1);
 	}
-	return rows.at(row_index).at(column_index);
+	return elements[row_index * number_of_columns + column_index];
 }
 
 template<typename DataType>
-inline DataType&
+inline const DataType&
 Matrix<DataType>::at(size_t row_index, size_t column_index) const {
 	if (row_index >= number_of_rows or column_index >= number_of_columns) {
 		std::cerr << "ERROR! Matrix bounds exceeded" << std::endl;
 		exit(-1);
 	}
-	return rows.at(row_index).at(column_index);
+	return elements[row_index * number_of_columns + column_index];
 }
 
 template<typename DataType>
@@ -156,13 +214,13 @@ Matrix<DataType>::operator+(const Matrix& matrix) {
 		exit(-1);
 	}
 
-	if (number_of_columns == matrix.number_of_columns) {
+	if (number_of_columns != matrix.number_of_columns) {
 		std::cerr << "Number of columns are not equal" << std::endl;
 		exit(-1);
 	}
 
-	for (size_t row = 0; row < number_of_rows; row++) {
-		rows.at(row) += matrix.rows.at(row);
+	for (size_t i = 0; i < elements.size(); i++) {
+		elements[i] += matrix.elements[i];
 	}
 
 	return *this;
@@ -178,14 +236,15 @@ template<typename DataType>
 inline
 void Matrix<DataType>::SwapRows(size_t row_1, size_t row_2) {
 	if (row_1 != row_2)
-		rows[row_1].swap(rows[row_2]);
+		std::swap_ranges((*this)[row_1], (*this)[row_1] + number_of_columns,
+				(*this)[row_2]);
 }
 
 template<typename DataType>
 inline
 void Matrix<DataType>::SwapColumns(size_t column_1, size_t column_2) {
 	for (size_t row = 0; row < number_of_rows; row++)
-		std::swap(rows[row][column_1], rows[row][column_2]);
+		std::swap((*this)[row][column_1], (*this)[row][column_2]);
 }
 
 template<typename DataType>
@@ -194,17 +253,69 @@ void Matrix<DataType>::swap(Matrix& matrix) {
 	std::swap(matrix.number_of_rows, number_of_rows);
 	std::swap(matrix.number_of_columns, number_of_columns);
 
-	rows.swap(matrix.rows);
+	elements.swap(matrix.elements);
 }
 
 template<typename DataType>
 void Matrix<DataType>::symmetrize() {
-	for (int row = 0; row < number_of_rows; row++) {
-		for (int column = 0; column < row; column++) {
+	for (size_t row = 0; row < number_of_rows; row++) {
+		for (size_t column = 0; column < row; column++) {
 			at(row, column) = at(column, row) = (at(row, column)
 					+ at(column, row)) / 2;
 		}
 	}
 }
 
+template<typename DataType>
+void Matrix<DataType>::transpose_to(Matrix& matrix) const {
+	matrix.resize(number_of_columns, number_of_rows);
+	for (size_t row = 0; row < number_of_rows; row++) {
+		for (size_t column = 0; column < number_of_columns; column++)
+			matrix[column][row] = (*this)[row][column];
+	}
+}
+
+/**
+ * C = A * B for the first n_rows rows of A and C.
+ * C must already be sized, only its first n_rows rows are written.
+ *
+ * Blocked over the rows of A and the shared dimension so a tile of B stays in cache
+ * while it is applied to a tile of rows. The inner step adds a multiple of a row of B to
+ * a row of C, row_update(alpha, b_row, c_row, n), so callers can pass a vectorised
+ * version. Zero elements of A are skipped, which makes sparse rows cheap.
+ */
+template<typename DataType, typename RowUpdate>
+void multiply(const Matrix<DataType>& A, const Matrix<DataType>& B, Matrix<DataType>& C, size_t n_rows, RowUpdate row_update) {
+	const size_t row_tile = 32;
+	const size_t inner_tile = 64;
+
+	size_t n_inner = A.number_of_columns;
+	size_t n_columns = B.number_of_columns;
+
+	for (size_t row = 0; row < n_rows; row++)
+		std::fill(C[row], C[row] + n_columns, DataType());
+
+	for (size_t row_start = 0; row_start < n_rows; row_start += row_tile) {
+		size_t row_end = std::min(row_start + row_tile, n_rows);
+		for (size_t inner_start = 0; inner_start < n_inner; inner_start += inner_tile) {
+			size_t inner_end = std::min(inner_start + inner_tile, n_inner);
+			for (size_t row = row_start; row < row_end; row++) {
+				const DataType* a = A[row];
+				DataType* c = C[row];
+				for (size_t k = inner_start; k < inner_end; k++) {
+					if (a[k] == DataType()) continue;
+					row_update(a[k], B[k], c, n_columns);
+				}
+			}
+		}
+	}
+}
+
+template<typename DataType>
+void multiply(const Matrix<DataType>& A, const Matrix<DataType>& B, Matrix<DataType>& C, size_t n_rows) {
+	multiply(A, B, C, n_rows, [](DataType alpha, const DataType* b, DataType* c, size_t n) {
+		for (size_t i = 0; i < n; i++) c[i] += alpha * b[i];
+	});
+}
+
 #endif
@@ -7,6 +7,11 @@
 #include "IO/Files.h"
 
 #include "ModelParts/SubstitutionModels/Parameters.h"
+#include "ModelParts/StateKernels.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 extern Environment env;
 extern IO::Files files;
@@ -72,6 +77,24 @@ void Model::Initialize(IO::RawTreeNode* &raw_tree, IO::raw_substitution_model* &
   substitution_model = new SubstitutionModel(u);
   substitution_model->from_raw_model(raw_sm);
 
+  // Joint update of the continuous rate parameters, those with bounds set by other parameters are left out.
+  hmc = nullptr;
+  if(env.get_or<bool>("MCMC.hmc", false)) {
+    std::vector<ContinuousFloat*> continuous = {};
+    for(AbstractComponent* parameter : substitution_model->get_all_parameters()) {
+      ContinuousFloat* cf = dynamic_cast<ContinuousFloat*>(parameter);
+      if(cf != nullptr and cf->get_type() == "CONTINUOUS_FLOAT" and cf->fixed_boundsp() and cf->get_lower_bound() < cf->get_upper_bound()) {
+	continuous.push_back(cf);
+      }
+    }
+
+    if(continuous.empty()) {
+      std::cout << "Warning: no continuous parameters for the Hamiltonian update." << std::endl;
+    } else {
+      hmc = new HamiltonianUpdate(continuous);
+    }
+  }
+
   // Add all substitution parameters to component set.
   std::list<AbstractComponent*> sm_parameters = substitution_model->get_all_parameters();
   for(auto it = sm_parameters.begin(); it != sm_parameters.end(); ++it) {
@@ -134,9 +157,18 @@ void Model::Initialize(IO::RawTreeNode* &raw_tree, IO::raw_substitution_model* &
   tree = new Tree();
   tree->Initialize(raw_tree);
   tree->connect_substitution_model(substitution_model);
-  tree->configure_branches(tree->root, n_col_opt.value(), state_domain_names);
+  tree->configure_branches(n_col_opt.value(), state_domain_names);
 
   // Configuring sequences.
+#ifdef _OPENMP
+  int n_threads = env.get_or<int>("MCMC.threads", 0);
+  if(n_threads > 0) omp_set_num_threads(n_threads);
+  std::cout << "\tUsing " << omp_get_max_threads() << " threads." << std::endl;
+#endif
+
+  StateKernels::select(env.get_or<std::string>("MCMC.state_kernels", "auto"));
+  std::cout << "\tUsing " << StateKernels::get().name << " state kernels." << std::endl;
+
   unsigned int n_sample = env.get<unsigned int>("MCMC.position_sample_count");
   RateVectorAssignmentParameter* rvap = new RateVectorAssignmentParameter(tree);
 
@@ -180,6 +212,14 @@ void Model::Initialize(IO::RawTreeNode* &raw_tree, IO::raw_substitution_model* &
   components.add_parameter(cp);
 
   components.Initialize();
+  substitution_model->index_modified_locations();
+  if(hmc != nullptr) hmc->setup(substitution_model, &counts);
+
+  // Samplers that score candidate values themselves.
+  LikelihoodHooks::change = [this]() { return(CalculateChangeInLikelihood()); };
+  LikelihoodHooks::changes = [this](unsigned int n, const std::function<void(unsigned int)>& set_candidate, std::vector<double>& changes) {
+    CalculateChangesInLikelihood(n, set_candidate, changes);
+  };
 
   std::cout << "\tSetting initial parameter states." << std::endl;
 
@@ -214,6 +254,28 @@ void Model::reject() {
   ready = true;
 }
 
+// Schedule.
+bool Model::sampling_alignmentp() {
+  return(components.state_parameterp(components.get_current_parameter()));
+}
+
+unsigned int Model::alignment_count() {
+  return(msa_parameters.size());
+}
+
+unsigned int Model::alignment_column_count() {
+  // Column counts are the same across alignments.
+  if(msa_parameters.empty()) return(0);
+  return(msa_parameters.front()->get_column_count());
+}
+
+void Model::set_alignment_schedule(unsigned int freq, unsigned int n_sample) {
+  components.set_state_frequency(freq);
+  for(SequenceAlignmentParameter* msa_parameter : msa_parameters) {
+    msa_parameter->set_sample_count(n_sample);
+  }
+}
+
 // Likelihood Calculations.
 double Model::CalculateLikelihood() {
   /*
@@ -242,6 +304,9 @@ double Model::CalculateLikelihood() {
       logL_subs += C_xy[i] * log((*rv)[i]);
     }
   }
+
+  // Any changes to the counts are now accounted for.
+  counts.clear_changes();
  
   return(logL_waiting + logL_subs);
 }
@@ -254,18 +319,73 @@ double Model::CalculateChangeInLikelihood(){
   double delta_logL = 0.0;
  
   RateVector* rv;
-  int C_xy;
+  double C_xy;
+
+  for(const rv_loc& location : substitution_model->modified_locations(components.get_current_parameter())) {
+    rv = location.rv;
+    C_xy = counts.subs_by_rateVector[rv][location.pos];
+    delta_logL += C_xy * log(rv->get_rate_ratio(location.pos));
+  }
+
+  /*
+   * Counts changed by resampling the alignment, only the changed cells contribute.
+   * Branch counts are truncated as in the full calculation.
+   */
+  for(const rv_count_change& change : counts.changed_rate_vectors) {
+    delta_logL += (change.new_count - change.old_count) * log((*change.rv)[change.pos]);
+  }
 
-  for(auto it = substitution_model->modified_begin(components.get_current_parameter());
-      it.at_end() == false; ++it) { 
-    rv = (*it).rv;
-    C_xy = counts.subs_by_rateVector[rv][(*it).pos];
-    delta_logL += C_xy * log(rv->get_rate_ratio((*it).pos));
+  double u = substitution_model->get_u();
+  for(const branch_count_change& change : counts.changed_branches) {
+    float branch_length = change.branch_length;
+    int delta_num0subs = (int)change.new_counts.num0subs - (int)change.old_counts.num0subs;
+    int delta_num1subs = (int)change.new_counts.num1subs - (int)change.old_counts.num1subs;
+
+    delta_logL += delta_num0subs * log(1/(1 + u*branch_length)) + delta_num1subs * log(branch_length/(1 + u*branch_length));
   }
+  counts.clear_changes();
 
   return(delta_logL);
 }
 
+void Model::CalculateChangesInLikelihood(unsigned int n, const std::function<void(unsigned int)>& set_candidate, std::vector<double>& changes) {
+  /*
+   * Changes in likelihood for n candidate values of the current parameter.
+   * The rate ratios at the modified locations are collected for every candidate, as setting a candidate refreshes
+   * shared components. The candidates are then scored in parallel against one flat copy of the counts.
+   */
+  rv_loc_span locations = substitution_model->modified_locations(components.get_current_parameter());
+  unsigned int n_locations = locations.end() - locations.begin();
+
+  std::vector<double> ratios(n * n_locations); // Row per candidate.
+  for(unsigned int c = 0; c < n; c++) {
+    set_candidate(c);
+    unsigned int l = 0;
+    for(const rv_loc& location : locations) {
+      ratios[c * n_locations + l] = location.rv->get_rate_ratio(location.pos);
+      l++;
+    }
+  }
+
+  std::vector<double> location_counts(n_locations);
+  unsigned int l = 0;
+  for(const rv_loc& location : locations) {
+    location_counts[l] = counts.subs_by_rateVector[location.rv][location.pos];
+    l++;
+  }
+
+  changes.assign(n, 0.0);
+  #pragma omp parallel for schedule(static) if(n * n_locations >= 4096)
+  for(unsigned int c = 0; c < n; c++) {
+    const double* row = &ratios[c * n_locations];
+    double change = 0.0;
+    for(unsigned int l = 0; l < n_locations; l++) {
+      if(location_counts[l] != 0.0) change += location_counts[l] * log(row[l]);
+    }
+    changes[c] = change;
+  }
+}
+
 // Printing/Recording
 void Model::RecordState(uint128_t gen, double l) {
 	/*
@@ -6,12 +6,15 @@
 #ifndef Model_h_
 #define Model_h_
 
+#include <functional>
+#include <vector>
 #include <boost/multiprecision/cpp_int.hpp>
 
 #include "SubstitutionCounts.h"
 #include "ModelParts/Trees/Tree.h"
 #include "ModelParts/SubstitutionModels/SubstitutionModel.h"
 #include "ModelParts/ComponentSet.h"
+#include "ModelParts/HamiltonianUpdate.h"
 #include "Data.h"
 
 using boost::multiprecision::uint128_t;
@@ -25,8 +28,15 @@ public:
   void accept();
   void reject();
 
+  // Schedule of the alignment updates.
+  bool sampling_alignmentp(); // True if the next component to be sampled is an alignment.
+  unsigned int alignment_count();
+  unsigned int alignment_column_count();
+  void set_alignment_schedule(unsigned int freq, unsigned int n_sample);
+
   double CalculateLikelihood();
   double CalculateChangeInLikelihood();
+  void CalculateChangesInLikelihood(unsigned int n, const std::function<void(unsigned int)>& set_candidate, std::vector<double>& changes);
   double PartialCalculateLikelihood(const double lnL);
 
   void RecordState(uint128_t gen, double l);
@@ -44,6 +54,7 @@ private:
 
   Tree* tree;
   CountsParameter* cp;
+  HamiltonianUpdate* hmc; // Joint update of the continuous rate parameters, if used.
 
   std::list<SequenceAlignmentParameter*> msa_parameters;
 };
@@ -6,9 +6,41 @@
 
 extern Environment env;
 
+// UNDO LOG
+
+UndoLog::UndoLog() {
+  entries = {};
+  transaction = 1; // Components start with a stamp of 0.
+}
+
+void UndoLog::write(double& slot, double& previous, unsigned long& stamp, double new_value) {
+  /*
+   * Components are often refreshed more than once per proposal, only the value from before the proposal is kept.
+   * This is also the old value for the rate ratios of the proposal.
+   */
+  if(stamp != transaction) {
+    stamp = transaction;
+    previous = slot;
+    entries.push_back({&slot, slot});
+  }
+  slot = new_value;
+}
+
+void UndoLog::rollback() {
+  for(auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    *(it->slot) = it->old_value;
+  }
+  clear();
+}
+
+void UndoLog::clear() {
+  entries.clear();
+  transaction++;
+}
+
 // ABSTRACT COMPONENT
 
-AbstractComponent::AbstractComponent(std::string name) : name(name), hidden(false) {
+AbstractComponent::AbstractComponent(std::string name) : name(name), hidden(false), log_stamp(0) {
   static int idc = -1;
   idc++;
   ID = idc;
@@ -4,6 +4,7 @@
 #include <string>
 #include <list>
 #include <set>
+#include <vector>
 
 // Given these current class definitions there cannot be a samplable parameter that is also dependent on other
 // parameters - such as category parameters.
@@ -12,8 +13,26 @@ typedef struct sample_status {
   bool testp; // true if metropolis hasting sampling is required.
   bool updatedp; // true if the component has actually changed.
   bool full_recalculation; // True if full likelihood calculation is required.
+  double log_hastings = 0.0; // Added to the log acceptance ratio of proposals that are not symmetric.
 } sample_status;
 
+// Derived values changed by the current proposal, as (slot, old value) entries.
+// A reject restores them in reverse without recomputing anything, an accept just clears the log.
+class UndoLog {
+public:
+  UndoLog();
+  void write(double& slot, double& previous, unsigned long& stamp, double new_value); // Sets slot, logging it the first time in a proposal.
+  void rollback();
+  void clear();
+private:
+  struct Entry {
+    double* slot;
+    double old_value;
+  };
+  std::vector<Entry> entries;
+  unsigned long transaction; // Current proposal, matched against the component stamps.
+};
+
 class Valuable {
 public:
   Valuable();
@@ -32,6 +51,7 @@ protected:
   std::list<AbstractComponent*> dependents; // Components that depend on this parameter.
   std::list<AbstractComponent*> refresh_list; // List of AbstractComponent that must be refreshed when this AbstractComponent changes.
   std::list<Valuable*> valuable_dependents; // List of dependents of valuable type.
+  unsigned long log_stamp; // Last undo log transaction that changed this component.
 
   std::list<AbstractComponent*> next_dependents(std::list<AbstractComponent*>, std::set<AbstractComponent*>&);
 public:
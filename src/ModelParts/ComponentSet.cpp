@@ -6,9 +6,13 @@
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
 
 extern Environment env;
 extern IO::Files files;
+extern UndoLog undo_log;
 
 // Constructors.
 ComponentSet::ComponentSet() {
@@ -35,7 +39,7 @@ void ComponentSet::Initialize() {
     }
   }
   
-  current_parameter = sampleable_parameter_list.begin();
+  current_parameter = 0;
 
   // Reverse dependancies to set up dependents.
   for(auto p = all_parameters.begin(); p != all_parameters.end(); ++p) {
@@ -50,14 +54,25 @@ void ComponentSet::Initialize() {
     parameter->setup_refresh_list();
   }
 
+  setup_virtual_bounds();
+
   // Refreshes all dependancies.
   this->reset_dependencies();
 
+  for(const auto& [_, parameter] : all_parameters) {
+    VirtualSubstitutionRate* rate = dynamic_cast<VirtualSubstitutionRate*>(parameter);
+    if(rate != nullptr and not rate->in_boundsp()) {
+      std::cerr << "Error: the initial value of " << rate->get_name() << " (" << rate->get_value()
+		<< ") is out of bounds, virtual substitution rates must be within (0, 1]." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
   // TODO offset.
   // Spread out state parameters so the don't update all at once.
   unsigned int len = state_parameters.size();
   int freq = env.get<int>("MCMC.alignment_sample_frequency");
-  int offset = 0;
+  uint64_t offset = 0;
 
   for(auto it = state_parameters.begin(); it != state_parameters.end(); ++it) {
     for(auto jt = sampleable_parameter_list.begin(); jt != sampleable_parameter_list.end(); ++jt) {
@@ -68,6 +83,8 @@ void ComponentSet::Initialize() {
     }
   }
 
+  build_schedule();
+
   // Parameter's value file.
   files.add_file("parameters_out", env.get<std::string>("OUTPUT.parameters_out_file"), IOtype::OUTPUT);
 
@@ -99,7 +116,7 @@ void ComponentSet::add_parameter(AbstractComponent* param, unsigned int max_samp
     // Check if Parameter has already been seen.
     SampleableComponent* p = dynamic_cast<SampleableComponent*>(param);
     if(p != NULL) {
-      sampleable_parameter_list.push_back({p, max_sample_freq, 0});
+      sampleable_parameter_list.push_back({p, max_sample_freq, 0, 1.0});
     }
 
     all_parameters[param->get_ID()] = param;
@@ -114,18 +131,45 @@ void ComponentSet::add_state_parameter(AbstractComponent* param, unsigned int ma
 // Utils.
 
 SampleableComponent* ComponentSet::get_current_parameter() {
-  return((*current_parameter).ptr);
+  return(sampleable_parameter_list[current_parameter].ptr);
+}
+
+bool ComponentSet::state_parameterp(AbstractComponent* param) {
+  return(std::find(state_parameters.begin(), state_parameters.end(), param->get_ID()) != state_parameters.end());
 }
 
 void ComponentSet::refresh_dependancies(AbstractComponent* v) {
   for(AbstractComponent* c : v->get_refresh_list()) c->refresh();
 }
 
+void ComponentSet::setup_virtual_bounds() {
+  virtual_rates = {};
+  for(const SampleCounter& counter : sampleable_parameter_list) {
+    std::vector<VirtualSubstitutionRate*> rates = {};
+    for(AbstractComponent* c : counter.ptr->get_refresh_list()) {
+      VirtualSubstitutionRate* rate = dynamic_cast<VirtualSubstitutionRate*>(c);
+      if(rate != nullptr and std::find(rates.begin(), rates.end(), rate) == rates.end()) rates.push_back(rate);
+    }
+    virtual_rates.push_back(rates);
+
+    if(ContinuousFloat* cf = dynamic_cast<ContinuousFloat*>(counter.ptr)) cf->setup_virtual_bounds();
+    if(DiscreteFloat* df = dynamic_cast<DiscreteFloat*>(counter.ptr)) df->setup_virtual_bounds();
+  }
+}
+
+bool ComponentSet::in_boundsp(unsigned int pos) {
+  for(VirtualSubstitutionRate* rate : virtual_rates[pos]) {
+    if(not rate->in_boundsp()) return(false);
+  }
+  return(true);
+}
+
 void ComponentSet::reset_dependencies() {
   for(const auto& [_, parameter] : all_parameters) {
     refresh_dependancies(parameter);
     parameter->fix();
   }
+  undo_log.clear();
 }
 
 // Sampling.
@@ -134,63 +178,223 @@ sample_status ComponentSet::sample() {
    * Sample the current parameters.
    */
 
-  steps++;
+  while(true) {
+    steps++;
 
-  SampleableComponent* param = get_current_parameter();
+    SampleableComponent* param = get_current_parameter();
+    sample_status s = param->sample();
+    refresh_dependancies(param);
 
-  //std::cout << std::endl << "Start: " << param->get_name() << std::endl;
-  sample_status s = param->sample();
+    /*
+     * Rate parameters keep the virtual rates that are linear in them within bounds when proposing.
+     * Any other dependent virtual rate is checked here, if it is out of bounds the change is undone and
+     * the next parameter is tried.
+     */
+    if(in_boundsp(current_parameter)) {
+      SampleCounter& counter = sampleable_parameter_list[current_parameter];
+      counter.last_sample = steps;
+      if(limitedp(counter)) find_next_due();
+
+      return(s);
+    }
 
-  try {
-    refresh_dependancies(param);
+    param->undo();
+    undo_log.rollback();
+    stepToNextParameter();
   }
+}
 
-  catch(OutOfBoundsException &exception) {
-    // A dependent parameter is out of bounds, undo the change
-    // and try again.
-    param->undo();
+inline void ComponentSet::stepToNextParameter() {
+  /*
+   * Sets current_parameter to the next sample.
+   * Components without a frequency limit are always available, so unless a limited component is due this is a
+   * single lookup.
+   */
+  if(this->sampleable_parameter_list.size() <= 1) return;
 
-    refresh_dependancies(param);
+  bool duep = steps >= next_due;
 
-    stepToNextParameter();
-    s = sample();
-  }
+  switch(scan) {
+  case Scan::SYSTEMATIC: {
+    if(not duep) {
+      if(next_unlimited[current_parameter] != -1) {
+	current_parameter = next_unlimited[current_parameter];
+      } else {
+	// Nothing to pick from yet, take whatever is due first.
+	current_parameter = earliest_due();
+      }
+      return;
+    }
 
-  current_parameter->last_sample = steps;
+    // Next component after the current one that is either not limited or due.
+    unsigned int n = sampleable_parameter_list.size();
+    unsigned int pos = current_parameter;
+    do {
+      pos = (pos + 1) % n;
+    } while(limitedp(sampleable_parameter_list[pos]) and steps < due_step(sampleable_parameter_list[pos]));
+    current_parameter = pos;
+    break;
+  }
+  case Scan::RANDOM: {
+    if(duep or unlimited_positions.empty()) {
+      current_parameter = earliest_due();
+      return;
+    }
 
-  return(s);
+    // Walker's alias method.
+    unsigned int i = alias_column(scan_rng);
+    current_parameter = (alias_coin(scan_rng) < alias_probs[i]) ? unlimited_positions[i] : unlimited_positions[alias[i]];
+    break;
+  }
+  }
 }
 
-inline void ComponentSet::stepToNextParameter() {
+// Schedule.
+
+void ComponentSet::build_schedule() {
   /*
-   * Sets the current_parameter iterator to the next sample.
+   * Precomputes the scan. Called once the frequency offsets are set.
    */
-  if(this->sampleable_parameter_list.size() <= 1) return;
+  std::string option = env.get_or<std::string>("MCMC.scan", "systematic");
+  if(option == "systematic") {
+    scan = Scan::SYSTEMATIC;
+  } else if(option == "random") {
+    scan = Scan::RANDOM;
+  } else {
+    std::cerr << "Error: scan \"" << option << "\" not recognized. Options are systematic or random." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  unsigned int n = sampleable_parameter_list.size();
+  limited_positions = {};
+  unlimited_positions = {};
+  for(unsigned int pos = 0; pos < n; pos++) {
+    SampleCounter& counter = sampleable_parameter_list[pos];
+    if(limitedp(counter)) {
+      limited_positions.push_back(pos);
+    } else {
+      unlimited_positions.push_back(pos);
+      counter.weight = env.get_or<double>("MCMC.scan_weights." + counter.ptr->get_name(), 1.0);
+      if(counter.weight < 0.0) {
+	std::cerr << "Error: scan weight of \"" << counter.ptr->get_name() << "\" is negative." << std::endl;
+	exit(EXIT_FAILURE);
+      }
+    }
+  }
 
-  ++current_parameter;
-  if(current_parameter == sampleable_parameter_list.end()) {
-    current_parameter = sampleable_parameter_list.begin();
+  // Walking twice around the list backwards finds the next unlimited position for every position.
+  next_unlimited = std::vector<int>(n, -1);
+  int next = -1;
+  for(int k = 2 * (int)n - 1; k >= 0; k--) {
+    unsigned int pos = k % n;
+    if(k < (int)n) next_unlimited[pos] = next;
+    if(not limitedp(sampleable_parameter_list[pos])) next = pos;
   }
 
-  if((steps - current_parameter->last_sample) + 1 < current_parameter->freq) {
-    stepToNextParameter();
+  // Alias table of the weights.
+  unsigned int m = unlimited_positions.size();
+  double total = 0.0;
+  for(unsigned int pos : unlimited_positions) total += sampleable_parameter_list[pos].weight;
+  if(scan == Scan::RANDOM and m > 0 and total <= 0.0) {
+    std::cerr << "Error: scan weights add up to 0." << std::endl;
+    exit(EXIT_FAILURE);
   }
+
+  alias_probs = std::vector<double>(m, 1.0);
+  alias = std::vector<unsigned int>(m, 0);
+  std::vector<double> scaled(m);
+  std::vector<unsigned int> small = {};
+  std::vector<unsigned int> large = {};
+  for(unsigned int i = 0; i < m; i++) {
+    scaled[i] = sampleable_parameter_list[unlimited_positions[i]].weight * m / total;
+    if(scaled[i] < 1.0) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+  while(not small.empty() and not large.empty()) {
+    unsigned int s = small.back(); small.pop_back();
+    unsigned int l = large.back();
+    alias_probs[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= (1.0 - scaled[s]);
+    if(scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  for(unsigned int i : small) alias_probs[i] = 1.0;
+  for(unsigned int i : large) alias_probs[i] = 1.0;
+
+  if(scan == Scan::RANDOM and m > 0) {
+    unsigned int scan_seed = std::rand();
+    std::seed_seq seed = {scan_seed};
+    scan_rng.seed(seed);
+    alias_column = std::uniform_int_distribution<unsigned int>(0, m - 1);
+    alias_coin = std::uniform_real_distribution<double>(0.0, 1.0);
+  }
+
+  find_next_due();
 }
 
-void ComponentSet::accept() {
-  SampleableComponent* cp = get_current_parameter();
+void ComponentSet::set_state_frequency(unsigned int max_sample_freq) {
+  /*
+   * Changes how often the state parameters are sampled. Each keeps its last sample, so the new countdown runs from there.
+   */
+  if(max_sample_freq < 2) {
+    std::cerr << "Error: state parameter sample frequency must be at least 2." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  for(SampleCounter& counter : sampleable_parameter_list) {
+    if(state_parameterp(counter.ptr)) counter.freq = max_sample_freq;
+  }
+  find_next_due();
+}
+
+bool ComponentSet::limitedp(const SampleCounter& counter) {
+  return(counter.freq > 1);
+}
+
+uint64_t ComponentSet::due_step(const SampleCounter& counter) {
+  return(counter.last_sample + counter.freq - 1);
+}
 
-  for(auto c = cp->get_refresh_list().begin(); c != cp->get_refresh_list().end(); ++c) {
-    (*c)->fix();
+void ComponentSet::find_next_due() {
+  next_due = std::numeric_limits<uint64_t>::max();
+  for(unsigned int pos : limited_positions) {
+    next_due = std::min(next_due, due_step(sampleable_parameter_list[pos]));
   }
+}
+
+int ComponentSet::earliest_due() {
+  int earliest = -1;
+  for(unsigned int pos : limited_positions) {
+    if(earliest == -1 or due_step(sampleable_parameter_list[pos]) < due_step(sampleable_parameter_list[earliest])) {
+      earliest = pos;
+    }
+  }
+  return(earliest);
+}
+
+void ComponentSet::accept() {
+  /*
+   * The dependents keep their new values, only the sampled component has anything to fix.
+   */
+  get_current_parameter()->fix();
+  undo_log.clear();
 
   stepToNextParameter();
 }
 
 void ComponentSet::reject() {
+  /*
+   * The dependents are restored from the undo log rather than refreshed again.
+   */
   get_current_parameter()->undo();
+  undo_log.rollback();
 
-  refresh_dependancies(get_current_parameter());
   stepToNextParameter();
 }
 
@@ -1,14 +1,19 @@
 #ifndef ComponentSet_h_
 #define ComponentSet_h_
 
+#include <cstdint>
 #include <list>
+#include <vector>
 #include <map>
+#include <random>
 #include <string>
 #include <boost/multiprecision/cpp_int.hpp>
 
 #include "AbstractComponent.h"
 #include "../SubstitutionCounts.h"
 
+class VirtualSubstitutionRate;
+
 /*
  * COMPONENT SET
  * This class holds a list of all components that can change through the course of the MCMC.
@@ -22,24 +27,53 @@
 struct SampleCounter {
   SampleableComponent* ptr; // Pointer to component.
   unsigned int freq; // Maximum sample frequency.
-  unsigned int last_sample; // The last time this component was sampled
+  uint64_t last_sample; // The last time this component was sampled
+  double weight; // Relative chance of being picked by a random scan.
 };
 
 class ComponentSet {
 private:
-  std::list<SampleCounter> sampleable_parameter_list;
+  std::vector<SampleCounter> sampleable_parameter_list;
   std::map<int, AbstractComponent*> all_parameters;
   std::map<int, SubstitutionCounts*> subs_by_parameter;
   std::list<int> state_parameters;
  
   // Tracking the current parameter.
-  std::list<SampleCounter>::iterator current_parameter; //Tracks the current parameter to be sampled, via an iterator across the parameter_list.
-  unsigned int steps; // Number of times sample() has been called. Used as reference for differant frequencies of component samples.
+  unsigned int current_parameter; // Position of the current parameter to be sampled in sampleable_parameter_list.
+  uint64_t steps; // Number of times sample() has been called. Used as reference for differant frequencies of component samples.
   void stepToNextParameter();
 
+  // Schedule.
+  // Components with a frequency limit wait for their countdown to run out, the rest are picked by the scan.
+  enum class Scan {
+    SYSTEMATIC, // In order.
+    RANDOM // By weight.
+  };
+  Scan scan;
+  std::vector<unsigned int> limited_positions; // Positions of the components with a frequency limit.
+  std::vector<unsigned int> unlimited_positions;
+  std::vector<int> next_unlimited; // Position -> next position without a limit, cyclically. -1 if there are none.
+  uint64_t next_due; // Earliest step at which a limited component can be sampled.
+  std::vector<double> alias_probs; // Alias table over unlimited_positions for the random scan.
+  std::vector<unsigned int> alias;
+  std::mt19937_64 scan_rng; // Seeded from the global generator, only used by the random scan.
+  std::uniform_int_distribution<unsigned int> alias_column;
+  std::uniform_real_distribution<double> alias_coin;
+
+  void build_schedule();
+  bool limitedp(const SampleCounter&);
+  uint64_t due_step(const SampleCounter&);
+  void find_next_due();
+  int earliest_due();
+
   // Dependancies.
   void refresh_dependancies(AbstractComponent*);
 
+  // Virtual rates refreshed by each sampleable component, which must stay in bounds.
+  std::vector<std::vector<VirtualSubstitutionRate*>> virtual_rates; // Position -> rates.
+  void setup_virtual_bounds();
+  bool in_boundsp(unsigned int pos);
+
   // Ptr to counts.
   SubstitutionCounts* counts;
 public:
@@ -57,6 +91,10 @@ public:
 
   // Getters.
   SampleableComponent* get_current_parameter();
+  bool state_parameterp(AbstractComponent* param);
+
+  // Schedule.
+  void set_state_frequency(unsigned int max_sample_freq);
   void reset_dependencies();
 
   // Output
@@ -0,0 +1,174 @@
+#include "HamiltonianUpdate.h"
+
+#include "../Environment.h"
+#include "SubstitutionModels/Parameters.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <utility>
+
+extern Environment env;
+
+HamiltonianUpdate::HamiltonianUpdate(std::vector<ContinuousFloat*> parameters) : SampleableComponent("HMC"), parameters(parameters) {
+  step_size = env.get_or<double>("MCMC.hmc_step_size", 0.5);
+  n_steps = env.get_or<int>("MCMC.hmc_leapfrog_steps", 10);
+  if(step_size <= 0.0 or n_steps < 1) {
+    std::cerr << "Error: hmc_step_size must be positive and hmc_leapfrog_steps at least 1." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // The parameters are refreshed after this component.
+  for(ContinuousFloat* parameter : parameters) parameter->add_dependancy(this);
+
+  hide();
+  fixedQ = true;
+  counts = nullptr;
+}
+
+void HamiltonianUpdate::setup(SubstitutionModel* SM, SubstitutionCounts* counts) {
+  this->counts = counts;
+
+  locations = {};
+  std::map<std::pair<RateVector*, int>, unsigned int> location_index = {};
+  for(const rv_loc& location : SM->modified_locations(this)) {
+    if(location_index.emplace(std::make_pair(location.rv, location.pos), locations.size()).second) {
+      locations.push_back(location);
+    }
+  }
+  location_counts = std::vector<double>(locations.size(), 0.0);
+
+  parameter_locations = {};
+  parameter_dependents = {};
+  for(ContinuousFloat* parameter : parameters) {
+    std::vector<unsigned int> indices = {};
+    for(const rv_loc& location : SM->modified_locations(parameter)) {
+      indices.push_back(location_index.at(std::make_pair(location.rv, location.pos)));
+    }
+    parameter_locations.push_back(indices);
+
+    const std::list<AbstractComponent*>& refresh_list = parameter->get_refresh_list();
+    parameter_dependents.push_back(std::set<AbstractComponent*>(refresh_list.begin(), refresh_list.end()));
+  }
+
+  virtual_rates = {};
+  std::set<AbstractComponent*> seen = {};
+  for(AbstractComponent* c : get_refresh_list()) {
+    VirtualSubstitutionRate* rate = dynamic_cast<VirtualSubstitutionRate*>(c);
+    if(rate != nullptr and seen.insert(c).second) virtual_rates.push_back(rate);
+  }
+
+  std::cout << "\tHamiltonian update of " << parameters.size() << " parameters over " << locations.size()
+	    << " rate vector locations." << std::endl;
+}
+
+void HamiltonianUpdate::print() {
+  std::cout << "HamiltonianUpdate - " << parameters.size() << " parameters" << std::endl;
+}
+
+std::string HamiltonianUpdate::get_type() {
+  return("HAMILTONIAN_UPDATE");
+}
+
+void HamiltonianUpdate::set_values(const std::vector<double>& values) {
+  for(unsigned int k = 0; k < parameters.size(); k++) parameters[k]->set_value(values[k]);
+  for(AbstractComponent* c : get_refresh_list()) c->refresh();
+}
+
+bool HamiltonianUpdate::in_boundsp() {
+  for(VirtualSubstitutionRate* rate : virtual_rates) {
+    if(not rate->in_boundsp()) return(false);
+  }
+  return(true);
+}
+
+void HamiltonianUpdate::gradient(std::vector<double>& g) {
+  /*
+   * d/dx sum C log(r) = sum C/r dr/dx, over the locations each parameter changes.
+   */
+  for(unsigned int k = 0; k < parameters.size(); k++) {
+    double total = 0.0;
+    for(unsigned int l : parameter_locations[k]) {
+      if(location_counts[l] == 0.0) continue;
+      Valuable* rate = locations[l].rv->rates[locations[l].pos];
+      bool linear = true;
+      total += location_counts[l] / rate->get_value() * value_slope(rate, parameters[k], parameter_dependents[k], linear);
+    }
+    g[k] = total;
+  }
+}
+
+sample_status HamiltonianUpdate::sample() {
+  /*
+   * Leapfrog trajectory with momenta scaled to the step size of each parameter.
+   * A parameter leaving its bounds is reflected back and its momentum reversed. A trajectory that pushes a virtual
+   * rate out of bounds ends where it started.
+   */
+  fixedQ = false;
+  unsigned int n = parameters.size();
+
+  for(unsigned int l = 0; l < locations.size(); l++) {
+    location_counts[l] = counts->subs_by_rateVector[locations[l].rv][locations[l].pos];
+  }
+
+  std::vector<double> x0(n), x(n), p(n), g(n), scale(n), lower(n), upper(n);
+  std::mt19937_64 rng(std::rand());
+  std::normal_distribution<double> normal(0.0, 1.0);
+  double kinetic0 = 0.0;
+  for(unsigned int k = 0; k < n; k++) {
+    x0[k] = x[k] = parameters[k]->get_value();
+    scale[k] = parameters[k]->get_step_size();
+    lower[k] = parameters[k]->get_lower_bound();
+    upper[k] = parameters[k]->get_upper_bound();
+    p[k] = normal(rng) / scale[k];
+    kinetic0 += 0.5 * scale[k] * scale[k] * p[k] * p[k];
+  }
+
+  gradient(g);
+  for(unsigned int step = 0; step < n_steps; step++) {
+    for(unsigned int k = 0; k < n; k++) {
+      p[k] += 0.5 * step_size * g[k];
+      x[k] += step_size * scale[k] * scale[k] * p[k];
+
+      while(x[k] < lower[k] or x[k] > upper[k]) {
+	x[k] = (x[k] < lower[k]) ? 2 * lower[k] - x[k] : 2 * upper[k] - x[k];
+	p[k] = -p[k];
+      }
+    }
+
+    set_values(x);
+    if(not in_boundsp()) {
+      set_values(x0);
+      return(sample_status({false, false, false}));
+    }
+
+    gradient(g);
+    for(unsigned int k = 0; k < n; k++) p[k] += 0.5 * step_size * g[k];
+  }
+
+  double kinetic1 = 0.0;
+  for(unsigned int k = 0; k < n; k++) kinetic1 += 0.5 * scale[k] * scale[k] * p[k] * p[k];
+
+  return(sample_status({true, true, false, kinetic0 - kinetic1}));
+}
+
+void HamiltonianUpdate::undo() {
+  // The parameters are restored from the undo log.
+  fixedQ = true;
+}
+
+void HamiltonianUpdate::fix() {
+  fixedQ = true;
+}
+
+void HamiltonianUpdate::refresh() {
+}
+
+std::string HamiltonianUpdate::get_state_header() {
+  return(name);
+}
+
+std::string HamiltonianUpdate::get_state() {
+  return("n/a");
+}
@@ -0,0 +1,56 @@
+/*
+ * Joint update of the continuous rate parameters by Hamiltonian Monte Carlo.
+ * Between alignment samples the counts are fixed, so the log likelihood of the rates is a sum of counts times log
+ * rates. Its gradient is found analytically through the arithmetic parameters and virtual substitution rates, and
+ * the parameters reflect off their bounds along the trajectory.
+ */
+
+#ifndef HamiltonianUpdate_h_
+#define HamiltonianUpdate_h_
+
+#include <set>
+#include <vector>
+
+#include "AbstractComponent.h"
+#include "../SubstitutionCounts.h"
+#include "SubstitutionModels/SubstitutionModel.h"
+
+class ContinuousFloat;
+class VirtualSubstitutionRate;
+
+class HamiltonianUpdate : public SampleableComponent {
+public:
+  HamiltonianUpdate(std::vector<ContinuousFloat*> parameters);
+  void setup(SubstitutionModel* SM, SubstitutionCounts* counts); // Once the modified locations are indexed.
+
+  void print() override;
+  std::string get_type() override;
+
+  sample_status sample() override;
+  void undo() override;
+  void fix() override;
+  void refresh() override;
+
+  std::string get_state_header() override;
+  std::string get_state() override;
+private:
+  std::vector<ContinuousFloat*> parameters;
+  std::vector<std::set<AbstractComponent*>> parameter_dependents; // Refreshed by each parameter.
+  std::vector<VirtualSubstitutionRate*> virtual_rates;
+
+  // Options
+  double step_size; // Leapfrog step, relative to the step size of each parameter.
+  unsigned int n_steps;
+
+  // Rate vector locations changed by any of the parameters, and the counts at them for the current trajectory.
+  SubstitutionCounts* counts;
+  std::vector<rv_loc> locations;
+  std::vector<double> location_counts;
+  std::vector<std::vector<unsigned int>> parameter_locations; // Parameter -> indices into locations.
+
+  void set_values(const std::vector<double>& values);
+  bool in_boundsp();
+  void gradient(std::vector<double>& g);
+};
+
+#endif
@@ -3,12 +3,17 @@
 #include <cassert>
 
 #include "Sequence.h"
+#include "StateKernels.h"
 #include "../Environment.h"
 #include "../IO/Files.h"
 
 #include "Trees/TreeParts.h"
 #include "Trees/Tree.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // Globals
 extern double Random();
 extern Environment env;
@@ -30,6 +35,13 @@ SequenceAlignment::SequenceAlignment(std::string name, std::string msa_out, std:
 
   this->seqs_out_file = msa_out;
   this->substitutions_out_file = subs_out;
+
+  this->window_size = 0;
+  this->state_kernels = &StateKernels::get();
+  this->n_patterns = 0;
+  this->single_domainp = false;
+
+  this->traversal_grain = 1;
 }
 
 void SequenceAlignment::add_internal(std::string name) {
@@ -40,35 +52,31 @@ void SequenceAlignment::add_internal(std::string name) {
   taxa_names_to_gaps[name] = std::vector<bool>(n_columns, true);
 }
 
-double** create_state_probability_vector(unsigned int n_cols, unsigned int n_states) {
-  double** m = new double*[n_cols];
-  for(unsigned int i = 0; i < n_cols; i++) {
-    m[i] = new double[n_states];
-    for(unsigned int j = 0; j < n_states; j++) {
-      m[i][j] = 0.0;
-    }
-  }
-
-  return(m);
-}
-
 void SequenceAlignment::add_base(std::string name, const IO::FreqSequence &seq) {
   taxa_names_to_sequences[name] = encode_sequence(sequenceAsStr_highestFreq(seq));
 
-  prior_state_distribution[name] = create_state_probability_vector(seq.size(), n_states);
+  // Only the states with non zero probability are kept, ordered by state.
+  TipPrior& prior = prior_state_distribution[name];
+  prior.start.push_back(0);
 
-  int pos = 0;
   // Loop through each position in Frequency Sequence
   for(auto it = seq.begin(); it != seq.end(); ++it) {
+    std::map<state_element, double> column;
     for(auto jt = it->begin(); jt != it->end(); ++jt) {
       // Loop through states.
       if(jt->state != '-') {
-        prior_state_distribution[name][pos][state_element_encode[std::string(1, jt->state)]] = jt->freq;
+        column[state_element_encode[std::string(1, jt->state)]] = jt->freq;
       } else {
         assert(jt->freq == 1.0);
       }
     }
-    pos++;
+
+    for(const auto& [state, prob] : column) {
+      if(prob == 0.0) continue;
+      prior.states.push_back(state);
+      prior.probs.push_back(prob);
+    }
+    prior.start.push_back(prior.states.size());
   }
 
   // Set gaps
@@ -131,9 +139,9 @@ void SequenceAlignment::initialize_site_static(IO::RawMSA raw_msa) {
         exit(EXIT_FAILURE);
       }
 
-      for(size_t i = 0; i < this->states.size(); ++i) {
-        double state_probability = this->prior_state_distribution[key][pos][i];
-        if (state_probability != 0.0 and state_probability != 1.0) {
+      const TipPrior& prior = this->prior_state_distribution[key];
+      for(unsigned int e = prior.start[pos]; e < prior.start[pos+1]; ++e) {
+        if (prior.probs[e] != 1.0) {
           std::cout << "Error: uncertain state in SITE_STATIC state domain \'" << this->domain_name << "\'." << std::endl;
           exit(EXIT_FAILURE);
         }
@@ -145,8 +153,17 @@ void SequenceAlignment::initialize_site_static(IO::RawMSA raw_msa) {
 void SequenceAlignment::saveToFile(int save_count, uint128_t gen, double l) {
   std::ostringstream buffer;
   buffer << "#" << save_count << ":" << gen << ":" << l << std::endl;
-  for(auto it = taxa_names_to_sequences.begin(); it != taxa_names_to_sequences.end(); ++it) {
-    buffer << ">" << it->first << "\n" << decode_state_element_sequence(it->second) << std::endl;
+
+  // Sequences at the split points are written along with the tree nodes, ordered by name.
+  std::map<std::string, const std::vector<state_element>*> all_sequences = {};
+  for(const auto& [name, sequence] : taxa_names_to_sequences) all_sequences[name] = &sequence;
+  for(unsigned int i = 0; i < tree->n_points(); i++) {
+    TreeNode* point = tree->point(i);
+    all_sequences[point->name] = &sequence_at(point);
+  }
+
+  for(const auto& [name, sequence] : all_sequences) {
+    buffer << ">" << name << "\n" << decode_state_element_sequence(*sequence) << std::endl;
   }
 
   files.write_to_file(seqs_out_identifier, buffer.str());
@@ -154,15 +171,14 @@ void SequenceAlignment::saveToFile(int save_count, uint128_t gen, double l) {
   std::ostringstream subs_buffer;
 
   // Save the substitutions for a particular state.
-  std::list<BranchSegment*> branches = tree->get_branches();
-  for(auto it = branches.begin(); it != branches.end(); ++it) {
+  for(BranchSegment& b : tree->get_branches()) {
     subs_buffer << save_count << "," << gen << "," << l << ",";
-    subs_buffer << (*it)->ancestral->name << "," << (*it)->decendant->name << ",[ ";
-    std::vector<Substitution> subs = (*it)->get_substitutions(domain_name);
+    subs_buffer << b.ancestral->name << "," << b.decendant->name << ",[ ";
+    const std::vector<Substitution>& subs = b.get_substitutions(domain_name);
     for(unsigned int pos = 0; pos < subs.size(); pos++) {
       if(subs[pos].occuredp == true) {
-        int anc = (*it)->ancestral->sequences[domain_name]->at(pos);
-        int dec = (*it)->decendant->sequences[domain_name]->at(pos);
+        int anc = b.ancestral->sequences[domain_name]->at(pos);
+        int dec = b.decendant->sequences[domain_name]->at(pos);
 
         // Includes virtual substitutions.
         subs_buffer << state_element_decode[anc] << pos << state_element_decode[dec] << " ";
@@ -178,14 +194,19 @@ void SequenceAlignment::syncWithTree(std::string domain_name, Tree* tree) {
     Connects all the tree nodes on the matching sequences in the MSAs for each state domain.
     Add new sequences to MSA for nodes present on the tree but missing in the alignment.
     This results in pointers from the TreeNodes to the sequence vectors.
+    Intermediate points on split branches share the gaps of the node at the bottom of the branch,
+    and only get their own sequences if the states can change.
    */
 
   this->tree = tree;
   std::cout << "\tAttaching \'" << domain_name << "\' states to tree." << std::endl;
 
-  for(const auto& node : tree->nodes()) {
-    this->marginal_state_distribution[node->name] = create_state_probability_vector(this->n_columns, this->n_states);
+  unsigned int n_nodes = tree->n_nodes();
+  node_priors = std::vector<const TipPrior*>(n_nodes, nullptr);
+  node_gaps = std::vector<std::vector<bool>*>(n_nodes, nullptr);
 
+  for(unsigned int i : tree->postorder()) {
+    TreeNode* node = tree->node(i);
     if(taxa_names_to_sequences.count(node->name)) {
       node->sequences[domain_name] = &(this->taxa_names_to_sequences.at(node->name));
     } else {
@@ -198,37 +219,97 @@ void SequenceAlignment::syncWithTree(std::string domain_name, Tree* tree) {
         node->sequences[domain_name] = &(this->taxa_names_to_sequences.at(node->name));	
       }
     }
+
+    if(node->isTip()) {
+      node_priors[i] = &prior_state_distribution.at(node->name);
+    }
+    node_gaps[i] = &(this->taxa_names_to_gaps.at(node->name));
   }
 
   // Set gaps for internal nodes.
-  for(const auto& node : tree->nodes()) {
+  for(unsigned int i : tree->postorder()) {
+    TreeNode* node = tree->node(i);
     if(node->isTip()) continue;
 
-    if(node->left != 0 and node->right == 0) {
+    std::vector<bool>& gaps = *node_gaps[i];
+    const std::vector<bool>& left_gaps = *node_gaps[tree->left(i)];
+    if(tree->right(i) == -1) {
       // Internal Continous.
-      TreeNode* dsNode = node->left->decendant; // ds = downstream.
-      for(unsigned int i = 0; i < dsNode->sequences[domain_name]->size(); i++) {
-        this->taxa_names_to_gaps[node->name][i] = this->taxa_names_to_gaps[dsNode->name][i];
-      }
+      gaps = left_gaps;
     } else {
-      for(unsigned int pos = 0; pos < node->sequences[domain_name]->size(); pos++) {
-        // Checks left branch first - there is always a left branch, except tips.
-        if(this->taxa_names_to_gaps[node->left->decendant->name][pos]) {
-          // Checks right branch next - right branches only on branching segment.
-          if(node->right) {
-            this->taxa_names_to_gaps[node->name][pos] = this->taxa_names_to_gaps[node->right->decendant->name][pos];
-          } else {
-            this->taxa_names_to_gaps[node->name][pos] = true;
-          }
-        } else {
-          this->taxa_names_to_gaps[node->name][pos] = false;
-        }
+      // A position is only a gap if it is a gap on both branches below.
+      const std::vector<bool>& right_gaps = *node_gaps[tree->right(i)];
+      for(unsigned int pos = 0; pos < n_columns; pos++) {
+        gaps[pos] = left_gaps[pos] and right_gaps[pos];
       }
     }
   }
 
+  // Intermediate points.
+  if(this->tag == Tag::DYNAMIC) {
+    point_sequences = std::vector<std::vector<state_element>>(tree->n_points(), std::vector<state_element>(n_columns, -1));
+  }
+  for(unsigned int i = 0; i < tree->n_points(); i++) {
+    TreeNode* point = tree->point(i);
+    if(this->tag == Tag::DYNAMIC) {
+      point->sequences[domain_name] = &point_sequences[i];
+    } else {
+      // Static states never change along a branch.
+      point->sequences[domain_name] = point->branch->decendant->sequences[domain_name];
+    }
+  }
+
   // Set initial states of internal sequences.
   for(unsigned int i = 0; i < n_columns ; i++) find_parsimony_by_position(i);
+
+  if(this->tag == Tag::DYNAMIC) {
+    find_site_patterns();
+
+    traversal_grain = env.get_or<int>("MCMC.traversal_grain", 4);
+#ifdef _OPENMP
+    workspaces = std::vector<Workspace>(omp_get_max_threads());
+#else
+    workspaces = std::vector<Workspace>(1);
+#endif
+    for(Workspace& ws : workspaces) ws.transitions.P.resize(n_states, n_states);
+
+    // Kernels are picked once for the size of the state space.
+    state_kernels = &StateKernels::get(n_states);
+    if(StateKernels::fixedp(n_states)) {
+      std::cout << "\t\tUsing " << state_kernels->name << " state kernels for " << n_states << " states." << std::endl;
+    }
+  }
+}
+
+void SequenceAlignment::find_site_patterns() {
+  /*
+   * Columns with the same data at every tip share a site pattern.
+   * Invariant columns with certain tips collapse to one pattern per state and gap layout.
+   */
+  std::map<std::string, unsigned int> patterns;
+  column_pattern = std::vector<unsigned int>(n_columns, 0);
+
+  for(unsigned int pos = 0; pos < n_columns; pos++) {
+    std::string key;
+    for(unsigned int i : tree->tips()) {
+      if((*node_gaps[i])[pos]) {
+        key.push_back('g');
+      } else {
+        const TipPrior* prior = node_priors[i];
+        key.push_back('p');
+        for(unsigned int e = prior->start[pos]; e < prior->start[pos+1]; e++) {
+          key.push_back(prior->states[e]);
+          key.append(reinterpret_cast<const char*>(&prior->probs[e]), sizeof(double));
+        }
+      }
+    }
+
+    column_pattern[pos] = patterns.insert({key, patterns.size()}).first->second;
+  }
+
+  n_patterns = patterns.size();
+  pattern_slot = std::vector<int>(n_patterns, -1);
+  std::cout << "\t\t" << n_columns << " columns with " << n_patterns << " unique site patterns." << std::endl;
 }
 
 // Reading Fasta files.
@@ -301,72 +382,139 @@ void SequenceAlignment::find_parsimony_by_position(unsigned int pos) {
    * This is not really parsimony at all, just selects the most common state observed
    * at the tips in the clade below.
    */
-  // Node names -> list of all states observed below a given node at a given site.
-  std::map<std::string, std::vector<state_element>> clade_states = {};
+  // Node index -> list of all states observed below a given node at a given site.
+  std::vector<std::vector<state_element>> clade_states(tree->n_nodes());
 
-  for (TreeNode* n : tree->nodes()) { // Recursively traverses the tree from the bottom up.
-    if(taxa_names_to_gaps[n->name][pos]) continue;
+  for (unsigned int i : tree->postorder()) { // Traverses the tree from the bottom up.
+    TreeNode* n = tree->node(i);
+    if((*node_gaps[i])[pos]) continue;
 
     if(n->isTip()) {
-      clade_states[n->name] = {n->sequences[domain_name]->at(pos)};
-    } else {
-      clade_states[n->name] = {};
+      clade_states[i] = {n->sequences[domain_name]->at(pos)};
     }
 
-    if(n->left != 0) {
-      for (const state_element& state : clade_states[n->left->decendant->name]) {
-        clade_states[n->name].push_back(state);
-      }
-    }
-    if(n->right != 0) {
-      for (const state_element& state : clade_states[n->right->decendant->name]) {
-        clade_states[n->name].push_back(state);
+    for(int child : {tree->left(i), tree->right(i)}) {
+      if(child != -1) {
+	clade_states[i].insert(clade_states[i].end(), clade_states[child].begin(), clade_states[child].end());
       }
     }
   }
 
-  for(auto it = tree->nodes().rbegin(); it != tree->nodes().rend(); ++it) {
-    TreeNode* n = *it;
-    if(n->isTip() or taxa_names_to_gaps[n->name][pos]) continue;
-    
-    int state_above;
-    if(n->up == nullptr) {
-      state_above = -1; // ROOT
-    } else {
-      state_above = (*n->up->ancestral->sequences[domain_name])[pos];
+  for(unsigned int i : tree->preorder()) {
+    TreeNode* n = tree->node(i);
+    if((*node_gaps[i])[pos]) continue;
+
+    int state_above = -1; // ROOT
+    if(n->up != nullptr) {
+      state_above = (*n->branch->ancestral->sequences[domain_name])[pos];
+
+      // The intermediate points of the branch above have the same clade below.
+      if(this->tag == Tag::DYNAMIC) {
+	for(TreeNode* point : n->branch->points) {
+	  state_above = pick_most_frequent_state(clade_states[i], state_above);
+	  (*point->sequences[domain_name])[pos] = state_above;
+	}
+      }
     }
 
-    //std::cout << n->name << " [ ";
-    //for(auto jt = clade_states[n->name].begin(); jt != clade_states[n->name].end(); ++jt) {
-    //  std::cout << (unsigned int)*jt << " ";
-    //}
-    //std::cout << "] " << (unsigned int)pick_most_frequent_state(clade_states[n->name], state_above) << std::endl;
-    
-    (*n->sequences[domain_name])[pos] = pick_most_frequent_state(clade_states[n->name], state_above);
+    if(n->isTip()) continue;
+    (*n->sequences[domain_name])[pos] = pick_most_frequent_state(clade_states[i], state_above);
   }
 }
 
-// SAMPLING
-void SequenceAlignment::reset_to_base(std::string node_name, const std::list<unsigned int>& positions) {
-  for (unsigned int pos : positions) {
-    for(unsigned int i = 0; i < n_states; i++) {
-      marginal_state_distribution[node_name][pos][i] = prior_state_distribution[node_name][pos][i];
+// NODE STORAGE
+void SequenceAlignment::set_window(const std::list<unsigned int>& positions) {
+  /*
+   * Maps the positions of the current sweep to slots in the marginal buffer.
+   * Marginals are only needed while a sweep is running, so the buffer is sized to the
+   * sampled window rather than the whole alignment and is reused between sweeps.
+   * Only allocated for alignments that are sampled.
+   */
+  if(window_slot.size() != n_columns) {
+    window_slot = std::vector<unsigned int>(n_columns, 0);
+  }
+
+  window_size = positions.size();
+  unsigned int slot = 0;
+  for (unsigned int pos : positions) window_slot[pos] = slot++;
+
+  size_t n = (size_t)(tree->n_nodes() + tree->n_points()) * window_size;
+  if(marginals.number_of_rows < n) {
+    marginals.resize(n, n_states);
+  }
+
+  for(Workspace& ws : workspaces) {
+    if(ws.stacked_rows.number_of_rows < window_size) {
+      ws.stacked_rows.resize(window_size, n_states);
+      ws.product_rows.resize(window_size, n_states);
+      ws.left_messages.resize(window_size, n_states);
+      ws.right_messages.resize(window_size, n_states);
+      ws.up_messages.resize(window_size, n_states);
     }
-  } 
+  }
 }
 
-void SequenceAlignment::normalize_state_probs(const TreeNode* node, unsigned int pos) {
-  double normalize_total = 0.0;
+double* SequenceAlignment::marginal_at(const TreeNode* node, unsigned int pos) {
+  // Tree nodes come first in the buffer, followed by the intermediate points.
+  size_t n = node->intermediatep ? tree->n_nodes() + node->index : node->index;
+  return(marginals[n * window_size + window_slot[pos]]);
+}
 
-  for(unsigned int i = 0; i < n_states; i++) {
-    normalize_total += this->marginal_state_distribution[node->name][pos][i];
+std::list<unsigned int> SequenceAlignment::pattern_representatives(const std::list<unsigned int>& positions) {
+  // The first position in the window with each site pattern.
+  std::list<unsigned int> representatives;
+  for(unsigned int pos : positions) {
+    int& slot = pattern_slot[column_pattern[pos]];
+    if(slot == -1) {
+      slot = window_slot[pos];
+      representatives.push_back(pos);
+    }
   }
 
-  if(normalize_total != 0.0) {
-    for(unsigned int i = 0; i < n_states; i++) {
-      this->marginal_state_distribution[node->name][pos][i] /= normalize_total;
+  return(representatives);
+}
+
+void SequenceAlignment::copy_pattern_marginals(const std::list<unsigned int>& positions) {
+  /*
+   * Copies the marginals of each representative to the other positions with the same pattern, at every node and point.
+   * Resets the pattern slots for the next sweep.
+   */
+  size_t n_rows = (size_t)(tree->n_nodes() + tree->n_points());
+  for(unsigned int pos : positions) {
+    unsigned int source = pattern_slot[column_pattern[pos]];
+    unsigned int slot = window_slot[pos];
+    if(source == slot) continue;
+
+    for(size_t n = 0; n < n_rows; n++) {
+      std::copy_n(marginals[n * window_size + source], n_states, marginals[n * window_size + slot]);
     }
   }
+
+  for(unsigned int pos : positions) pattern_slot[column_pattern[pos]] = -1;
+}
+
+const std::vector<bool>& SequenceAlignment::gaps_at(const TreeNode* node) {
+  // Intermediate points have the gaps of the node at the bottom of their branch.
+  if(node->intermediatep) {
+    return(*node_gaps[node->branch->decendant->index]);
+  }
+  return(*node_gaps[node->index]);
+}
+
+std::vector<state_element>& SequenceAlignment::sequence_at(const TreeNode* node) {
+  return(*(node->sequences.at(domain_name)));
+}
+
+// SAMPLING
+void SequenceAlignment::reset_to_base(TreeNode* node, const std::list<unsigned int>& positions) {
+  const TipPrior* prior = node_priors[node->index];
+  for (unsigned int pos : positions) {
+    double* probs = marginal_at(node, pos);
+    std::fill_n(probs, n_states, 0.0);
+    for(unsigned int e = prior->start[pos]; e < prior->start[pos+1]; e++) {
+      probs[prior->states[e]] = prior->probs[e];
+    }
+  } 
 }
 
 // Calculating Probabilities.
@@ -388,185 +536,311 @@ inline double calc_no_substitution_prob(double rate, float t_b, double u) {
   return((prob_virtual * ((rate * t_b) * denom)) + ((1.0 - prob_virtual) * denom));
 }
 
-double SequenceAlignment::find_state_prob_given_dec_branch(BranchSegment* branch,
-                                                           state_element state_i,
-                                                           double* state_probs,
-                                                           std::vector<Valuable*> rv,
-                                                           double u,
-                                                           unsigned int pos) {
+void SequenceAlignment::transition_row(BranchSegment* branch, RateVector* rv, state_element state_i, double u, double* row) {
   /*
-   * Find state probability given decendent branch
-   * state_probs = the marginal posterior distribution of the state at the node below.
+   * Probabilities of each focal domain state at the bottom of the branch given state_i at the top.
+   * rv = the RateVector selected with state_i in the focal domain.
    */
+  float t_b = branch->distance;
 
-  double prob = 0.0;
-  double focal_domain_prob = 0.0;
-  double alt_domain_prob = 1.0;
+  for(state_element state_j = 0; state_j < (state_element)n_states; state_j++) {
+    double rate = rv->rates[state_j]->get_value();
+    if(state_i != state_j) {
+      // Normal Substitution
+      row[state_j] = calc_substitution_prob(rate, t_b, u);
+    } else {
+      // No substitution - or possibly virtual.
+      row[state_j] = calc_no_substitution_prob(rate, t_b, u);
+    }
+  }
+}
 
+double SequenceAlignment::alt_domain_prob(BranchSegment* branch, state_element state_i, double u, unsigned int pos) {
+  /*
+   * Likelihood contribution of the substitutions in the non focal domains, given state_i in the focal domain.
+   * Independent of the focal state at the bottom of the branch.
+   */
+  double prob = 1.0;
   float t_b = branch->distance;
 
-  for(state_element state_j = 0; state_j < (state_element)n_states; state_j++) {
-    double state_prob = state_probs[state_j];
-
-    if(state_prob != 0.0) {
-      // Likelihood contribution of all substitutions - including alternate domains.
-      for(BranchSegment::iterator it = branch->begin(pos); it != branch->end(); it++) {
-        std::string domain = (*it).first;
-
-        if(domain == this->domain_name) {
-          double rate = rv[state_j]->get_value();
-          if(state_i != state_j) {
-            // Normal Substitution
-            focal_domain_prob = calc_substitution_prob(rate, t_b, u);
-          } else {
-            // No substitution - or possibly virtual.
-            focal_domain_prob = calc_no_substitution_prob(rate, t_b, u);
-          }
-        } else if (not this->tree->get_SM()->is_static(domain)) {
-          // Subsitutions in non focal domain.
-          Substitution sub = (*it).second;
-          std::map<std::string, state_element> context = {{domain, sub.anc_state},
-                                                          {this->domain_name, state_i}};
-
-          RateVector* rv = branch->get_hypothetical_rate_vector(domain, context, pos);
-
-          if(sub.occuredp and (sub.anc_state != sub.dec_state)) {
-            // Substitution including virtual substitutions.
-            alt_domain_prob *= calc_substitution_prob(rv->rates[sub.dec_state]->get_value(), t_b, u);
-          } else {
-            alt_domain_prob *= calc_no_substitution_prob(rv->rates[sub.anc_state]->get_value(), t_b, u);
-          }
-        }	
-      }
-      prob += (state_prob * focal_domain_prob * alt_domain_prob);
+  for(BranchSegment::iterator it = branch->begin(pos); it != branch->end(); it++) {
+    std::string domain = (*it).first;
+    if(domain == this->domain_name or this->tree->get_SM()->is_static(domain)) continue;
+
+    Substitution sub = (*it).second;
+    std::map<std::string, state_element> context = {{domain, sub.anc_state},
+                                                    {this->domain_name, state_i}};
 
-      // Reset state-specific probability terms.
-      focal_domain_prob = 0.0;
-      alt_domain_prob = 1.0;
+    RateVector* rv = branch->get_hypothetical_rate_vector(domain, context, pos);
+
+    if(sub.occuredp and (sub.anc_state != sub.dec_state)) {
+      // Substitution including virtual substitutions.
+      prob *= calc_substitution_prob(rv->rates[sub.dec_state]->get_value(), t_b, u);
+    } else {
+      prob *= calc_no_substitution_prob(rv->rates[sub.anc_state]->get_value(), t_b, u);
     }
   }
 
   return(prob);
 }
 
-double SequenceAlignment::find_state_prob_given_anc_branch(BranchSegment* branch, state_element state_j, double* state_probs, TreeNode* node, double u, unsigned int pos) {
+// Batched messages over the window.
+std::string SequenceAlignment::transition_context(BranchSegment* branch, unsigned int pos) {
   /*
-   * Find state probability given ancestor branch.
+   * The states of the other domains on the segment at pos.
+   * Positions with the same context have the same transition matrix and alt domain probabilities.
    */
+  std::string context;
+  for(BranchSegment::iterator it = branch->begin(pos); it != branch->end(); it++) {
+    std::string domain = (*it).first;
+    if(domain == this->domain_name) continue;
+
+    Substitution sub = (*it).second;
+    context.push_back(sub.anc_state);
+    if(not this->tree->get_SM()->is_static(domain)) {
+      context.push_back(sub.dec_state);
+      context.push_back(sub.occuredp and (sub.anc_state != sub.dec_state));
+    }
+  }
 
-  double prob = 0.0;
-  double focal_domain_prob = 0.0;
-  double alt_domain_prob = 1.0;
+  return(context);
+}
 
-  float t_b = branch->distance;
+void SequenceAlignment::build_context_table(const std::list<unsigned int>& positions) {
+  /*
+   * The states of the other domains are fixed while this domain is swept, so the RateVector selected for each
+   * focal state only depends on the context at each (segment, position).
+   * Each distinct context is looked up once per sweep, the segments then refer to it by id.
+   * The alt domain probabilities also depend on the segment so they get an entry per (segment, context).
+   * With a single domain there is only one context and the alt domain probabilities are all 1.0.
+   * Both are only filled in where the position is not a gap below the segment, as contexts only seen at gaps may
+   * have no RateVector. The table is read only during the passes so it can be shared between threads.
+   */
+  std::vector<BranchSegment>& segments = tree->get_branches();
+  single_domainp = tree->get_SM()->get_all_states().size() == 1;
+
+  context_ids.clear();
+  segment_contexts.resize(segments.size() * window_size);
+  segment_alt_entries.resize(segments.size() * window_size);
+  if(single_domainp) context_ids[""] = 0;
+
+  unsigned int n_alt_entries = 0;
+  for(unsigned int s = 0; s < segments.size(); s++) {
+    BranchSegment* branch = &segments[s];
+    std::map<unsigned int, unsigned int> alt_entries; // Context id -> entry.
+
+    for(unsigned int pos : positions) {
+      unsigned int id = 0;
+      if(not single_domainp) {
+        id = context_ids.insert({transition_context(branch, pos), context_ids.size()}).first->second;
+      }
+
+      auto entry = alt_entries.insert({id, n_alt_entries});
+      if(entry.second) n_alt_entries++;
+
+      segment_contexts[s * window_size + window_slot[pos]] = id;
+      segment_alt_entries[s * window_size + window_slot[pos]] = entry.first->second;
+    }
+  }
+
+  context_rate_vectors.assign(context_ids.size() * n_states, nullptr);
+  alt_probs.assign((size_t)n_alt_entries * n_states, 1.0);
+  std::vector<bool> alt_readyp(n_alt_entries, single_domainp);
 
-  for(state_element state_i = 0; state_i < (signed char)n_states; ++state_i) {
-    double state_prob = state_probs[state_i];
-    if(state_prob != 0.0) {
-      for(BranchSegment::iterator it = branch->begin(pos); it != branch->end(); it++) {
-        std::string domain = (*it).first;
+  for(unsigned int s = 0; s < segments.size(); s++) {
+    BranchSegment* branch = &segments[s];
+    const std::vector<bool>& gaps = gaps_at(branch->decendant);
+    double u = branch->decendant->SM->get_u();
 
-        if(domain == this->domain_name) {
-          // Focal Domain
+    for(unsigned int pos : positions) {
+      if(gaps[pos]) continue;
+      unsigned int slot = s * window_size + window_slot[pos];
+
+      RateVector** rvs = &context_rate_vectors[segment_contexts[slot] * n_states];
+      if(rvs[0] == nullptr) {
+        for(state_element state_i = 0; state_i < (state_element)n_states; state_i++) {
           std::map<std::string, state_element> context = {{this->domain_name, state_i}};
-          RateVector* rv = node->up->get_hypothetical_rate_vector(domain_name, context, pos);
-
-          double rate = rv->rates[state_j]->get_value(); // i -> j rate.
-          if(state_i != state_j) {
-            // Normal Substitution.
-            focal_domain_prob = calc_substitution_prob(rate, t_b, u); // Probability of the substitution.
-          } else {
-            // No substition - possibly virtual.
-            focal_domain_prob = calc_no_substitution_prob(rate, t_b, u);
-          }
+          rvs[state_i] = branch->get_hypothetical_rate_vector(domain_name, context, pos);
+        }
+      }
 
-        } else if (not this->tree->get_SM()->is_static(domain)) {
-          // Alternative domains.
-          Substitution sub = (*it).second;
-          std::map<std::string, state_element> context = {{domain, sub.anc_state},
-                                                          {this->domain_name, state_i}};
-          
-          RateVector* rv = branch->get_hypothetical_rate_vector(domain, context, pos);
-          if(sub.occuredp and (sub.anc_state != sub.dec_state)) {
-            //Substitution including virtual substitutions.
-            alt_domain_prob *= calc_substitution_prob(rv->rates[sub.dec_state]->get_value(), t_b, u);
-          } else {
-            alt_domain_prob *= calc_no_substitution_prob(rv->rates[sub.anc_state]->get_value(), t_b, u);
-          }
+      unsigned int entry = segment_alt_entries[slot];
+      if(not alt_readyp[entry]) {
+        double* alt = &alt_probs[(size_t)entry * n_states];
+        for(state_element state_i = 0; state_i < (state_element)n_states; state_i++) {
+          alt[state_i] = alt_domain_prob(branch, state_i, u, pos);
         }
+        alt_readyp[entry] = true;
       }
-      prob += (state_prob * focal_domain_prob * alt_domain_prob);
+    }
+  }
 
-      // Reset state-specific probability terms.
-      focal_domain_prob = 0.0;
-      alt_domain_prob = 1.0;
+  for(Workspace& ws : workspaces) {
+    if(ws.position_groups.size() < context_ids.size()) {
+      ws.position_groups.resize(context_ids.size());
     }
   }
+}
 
-  return(prob);
+unsigned int SequenceAlignment::segment_context(const BranchSegment* branch, unsigned int pos) {
+  size_t s = branch - tree->get_branches().data();
+  return(segment_contexts[s * window_size + window_slot[pos]]);
 }
 
-void SequenceAlignment::find_marginal_at_pos(TreeNode* node, unsigned int pos, TreeNode* left_node, TreeNode* right_node, TreeNode* up_node) {
-  double u = node->SM->get_u();
-  double left_prob = 1.0;
-  double right_prob = 1.0;
-  double up_prob = 1.0;
+const double* SequenceAlignment::segment_alt_probs(const BranchSegment* branch, unsigned int pos) {
+  size_t s = branch - tree->get_branches().data();
+  return(&alt_probs[(size_t)segment_alt_entries[s * window_size + window_slot[pos]] * n_states]);
+}
 
-  //unsigned long extended_state;
-  RateVector* rv;
+SequenceAlignment::Workspace& SequenceAlignment::workspace() {
+#ifdef _OPENMP
+  return(workspaces[omp_get_thread_num()]);
+#else
+  return(workspaces[0]);
+#endif
+}
 
-  for(state_element state_i = 0; state_i < (signed char)n_states; state_i++) {
-    // Most likely to be 0.0 so evaluated first.
-    if(up_node != nullptr) {
-      if(not taxa_names_to_gaps[up_node->name][pos]) {
-        up_prob = find_state_prob_given_anc_branch(node->up, state_i, marginal_state_distribution[up_node->name][pos], node, u, pos);
+void SequenceAlignment::group_positions(Workspace& ws, BranchSegment* branch, const std::vector<unsigned int>& positions, const std::vector<bool>& gaps) {
+  for(unsigned int id : ws.used_contexts) ws.position_groups[id].clear();
+  ws.used_contexts.clear();
+
+  for(unsigned int pos : positions) {
+    if(gaps[pos]) continue;
+
+    unsigned int id = segment_context(branch, pos);
+    if(ws.position_groups[id].empty()) ws.used_contexts.push_back(id);
+    ws.position_groups[id].push_back(pos);
+  }
+}
+
+void SequenceAlignment::build_transitions(Workspace& ws, BranchSegment* branch, unsigned int pos, double u) {
+  /*
+   * Fills the transition matrix, its transpose and the alt domain probabilities for the context at pos.
+   */
+  RateVector** rvs = &context_rate_vectors[segment_context(branch, pos) * n_states];
+  for(state_element state_i = 0; state_i < (state_element)n_states; state_i++) {
+    transition_row(branch, rvs[state_i], state_i, u, ws.transitions.P[state_i]);
+  }
+  ws.transitions.alt = segment_alt_probs(branch, pos);
 
-        // Return if probability if 0.0.
-        if(up_prob == 0.0) {
-          this->marginal_state_distribution[node->name][pos][state_i] = 0.0;
-          return;
+  ws.transitions.P.transpose_to(ws.transitions.Pt);
+}
+
+void SequenceAlignment::find_dec_messages(Workspace& ws, BranchSegment* branch, const TreeNode* child, const std::vector<unsigned int>& positions, Matrix<double>& messages) {
+  /*
+   * Message up a branch segment from the node below, for every position at once.
+   * messages[slot][i] = alt[i] * sum over j of P(i -> j) * child[j].
+   * The child marginals of positions sharing a context are stacked and multiplied by the transposed transition matrix.
+   * At tips only the states in the prior can be non zero, so their columns of the transition matrix are summed directly.
+   */
+  const StateKernels::KernelSet& kernels = *state_kernels;
+  double u = child->SM->get_u();
+  const TipPrior* prior = child->isTip() ? node_priors[child->index] : nullptr;
+
+  group_positions(ws, branch, positions, gaps_at(child));
+  for(unsigned int id : ws.used_contexts) {
+    const std::vector<unsigned int>& group = ws.position_groups[id];
+    build_transitions(ws, branch, group.front(), u);
+
+    if(prior != nullptr) {
+      for(unsigned int r = 0; r < group.size(); r++) {
+        unsigned int pos = group[r];
+        const double* probs = marginal_at(child, pos);
+        std::fill_n(ws.product_rows[r], n_states, 0.0);
+        for(unsigned int e = prior->start[pos]; e < prior->start[pos+1]; e++) {
+          state_element state_j = prior->states[e];
+          if(probs[state_j] != 0.0) kernels.axpy(probs[state_j], ws.transitions.Pt[state_j], ws.product_rows[r], n_states);
         }
       }
+    } else {
+      for(unsigned int r = 0; r < group.size(); r++) {
+        std::copy_n(marginal_at(child, group[r]), n_states, ws.stacked_rows[r]);
+      }
+
+      multiply(ws.stacked_rows, ws.transitions.Pt, ws.product_rows, group.size(), kernels.axpy);
     }
 
-    // Contribution of left branch.
-    if((left_node != nullptr) and not taxa_names_to_gaps[left_node->name].at(pos)) {
-      std::map<std::string, state_element> context = {{domain_name, state_i}};
-      rv = left_node->up->get_hypothetical_rate_vector(domain_name, context, pos);
+    for(unsigned int r = 0; r < group.size(); r++) {
+      kernels.multiply_to(messages[window_slot[group[r]]], ws.product_rows[r], ws.transitions.alt, n_states);
+    }
+  }
+}
 
-      left_prob = find_state_prob_given_dec_branch(left_node->up, state_i, marginal_state_distribution[left_node->name][pos], rv->rates, u, pos);
+void SequenceAlignment::find_anc_messages(Workspace& ws, BranchSegment* branch, const TreeNode* parent, const std::vector<unsigned int>& positions, Matrix<double>& messages) {
+  /*
+   * Message down a branch segment from the node above, for every position at once.
+   * messages[slot][j] = sum over i of parent[i] * alt[i] * P(i -> j).
+   * Zero weights are skipped by the multiply - after states are picked only one is left per row.
+   */
+  const StateKernels::KernelSet& kernels = *state_kernels;
+  double u = parent->SM->get_u();
 
-      if(left_prob == 0.0) {
-        this->marginal_state_distribution[node->name][pos][state_i] = 0.0;
-        return;
-      }
+  group_positions(ws, branch, positions, gaps_at(parent));
+  for(unsigned int id : ws.used_contexts) {
+    const std::vector<unsigned int>& group = ws.position_groups[id];
+    build_transitions(ws, branch, group.front(), u);
+
+    for(unsigned int r = 0; r < group.size(); r++) {
+      kernels.multiply_to(ws.stacked_rows[r], marginal_at(parent, group[r]), ws.transitions.alt, n_states);
     }
 
-    // Contribution of right branch.
-    if((right_node != nullptr) and (not taxa_names_to_gaps[right_node->name][pos])) {
-      std::map<std::string, state_element> context = {{domain_name, state_i}};
-      rv = right_node->up->get_hypothetical_rate_vector(domain_name, context, pos);
+    multiply(ws.stacked_rows, ws.transitions.P, ws.product_rows, group.size(), kernels.axpy);
 
-      right_prob = find_state_prob_given_dec_branch(right_node->up, state_i, marginal_state_distribution[right_node->name][pos], rv->rates, u, pos);
-      if(right_prob == 0.0) {
-        this->marginal_state_distribution[node->name][pos][state_i] = 0.0;
-        return;
-      }
+    for(unsigned int r = 0; r < group.size(); r++) {
+      std::copy_n(ws.product_rows[r], n_states, messages[window_slot[group[r]]]);
     }
+  }
+}
+
+std::vector<unsigned int> SequenceAlignment::active_positions(const TreeNode* node, const std::list<unsigned int>& positions) {
+  const std::vector<bool>& gaps = gaps_at(node);
 
-    this->marginal_state_distribution[node->name][pos][state_i] = left_prob * right_prob * up_prob;
+  std::vector<unsigned int> active;
+  active.reserve(positions.size());
+  for(unsigned int pos : positions) {
+    if(not gaps[pos]) active.push_back(pos);
   }
+
+  return(active);
 }
 
-void SequenceAlignment::find_state_probs_dec_only(TreeNode* node, std::list<unsigned int> positions) {
+void SequenceAlignment::find_marginals(TreeNode* node, const std::vector<unsigned int>& positions, TreeNode* left_node, TreeNode* right_node, TreeNode* up_node) {
+  /*
+   * Marginals at node combining the messages from the given neighbours, any of which may be nullptr.
+   * positions must not be gaps at node.
+   */
+  const StateKernels::KernelSet& kernels = *state_kernels;
+  Workspace& ws = workspace();
+
+  if(left_node != nullptr) find_dec_messages(ws, left_node->up, left_node, positions, ws.left_messages);
+  if(right_node != nullptr) find_dec_messages(ws, right_node->up, right_node, positions, ws.right_messages);
+  if(up_node != nullptr) find_anc_messages(ws, node->up, up_node, positions, ws.up_messages);
+
+  for(unsigned int pos : positions) {
+    unsigned int slot = window_slot[pos];
+    const double* left = (left_node != nullptr and not gaps_at(left_node)[pos]) ? ws.left_messages[slot] : nullptr;
+    const double* right = (right_node != nullptr and not gaps_at(right_node)[pos]) ? ws.right_messages[slot] : nullptr;
+    const double* up = (up_node != nullptr and not gaps_at(up_node)[pos]) ? ws.up_messages[slot] : nullptr;
+
+    double* probs = marginal_at(node, pos);
+    for(unsigned int i = 0; i < n_states; i++) {
+      double left_prob = left ? left[i] : 1.0;
+      double right_prob = right ? right[i] : 1.0;
+      double up_prob = up ? up[i] : 1.0;
+      probs[i] = left_prob * right_prob * up_prob;
+    }
+
+    kernels.normalize(probs, n_states);
+  }
+}
+
+void SequenceAlignment::find_state_probs_dec_only(TreeNode* node, const std::list<unsigned int>& positions) {
   /*
    * Finds the marginal posterior distribution for each position at a given node.
    * Only uses infomation from nodes below - used for upward recursion.
    * Assumes that node is not a tip.
    */
 
-  std::string name = node->name;
-  std::vector<bool> gaps = taxa_names_to_gaps[name];
   if(not node->isTip()) {
     // Node may or may not be a branch node - therefore may only have one child which is always the left one.
     // Set to nullptr if no right branch;
@@ -577,21 +851,13 @@ void SequenceAlignment::find_state_probs_dec_only(TreeNode* node, std::list<unsi
       right_node = nullptr;
     }
 
-    for (unsigned int pos : positions) {
-      if(not gaps[pos]) {
-        // Always a left node.
-        find_marginal_at_pos(node, pos, node->left->decendant, right_node, nullptr);
-        normalize_state_probs(node, pos);
-      }
-    }
+    find_marginals(node, active_positions(node, positions), node->left->decendant, right_node, nullptr);
   }
 }
 
 // TODO refactor.
-void SequenceAlignment::find_state_probs_all(TreeNode* node, std::list<unsigned int> positions) {
+void SequenceAlignment::find_state_probs_all(TreeNode* node, const std::list<unsigned int>& positions) {
   // NOTE assumes not a tip.
-  std::string name = node->name;
-  std::vector<bool> gaps = taxa_names_to_gaps[name];
 
   // Node may or may not be a branch node - therefore may only have one child which is always the left one.
   // Set to nullptr if no right branch;
@@ -609,47 +875,47 @@ void SequenceAlignment::find_state_probs_all(TreeNode* node, std::list<unsigned
     up_node = nullptr;
   }
  
-  for (unsigned int pos : positions) {
-    if(not gaps[pos]) {
-      find_marginal_at_pos(node, pos, node->left->decendant, right_node, up_node);
-      normalize_state_probs(node, pos);
-    }
-  }
+  find_marginals(node, active_positions(node, positions), node->left->decendant, right_node, up_node);
 }
 
 // Second recursion.
-void SequenceAlignment::update_state_probs(TreeNode* node, unsigned int pos, TreeNode* up_node) {
+void SequenceAlignment::update_state_probs(TreeNode* node, const std::vector<unsigned int>& positions, TreeNode* up_node) {
   // NOTE we can assume up_node is not a nullptr.
-  double u = node->SM->get_u();
-  double* state_probs = marginal_state_distribution[node->name][pos];
-
-  for(state_element state_j = 0; state_j < (signed char)n_states; state_j++) {
-    if(state_probs[state_j] != 0.0) {
-      //std::cout << "update: " << (unsigned int)state_j << std::endl;
-      state_probs[state_j] *= find_state_prob_given_anc_branch(node->up, state_j, marginal_state_distribution[up_node->name][pos], node, u, pos);
-    }
+  const StateKernels::KernelSet& kernels = *state_kernels;
+
+  Workspace& ws = workspace();
+  find_anc_messages(ws, node->up, up_node, positions, ws.up_messages);
+  for(unsigned int pos : positions) {
+    double* probs = marginal_at(node, pos);
+    kernels.multiply(probs, ws.up_messages[window_slot[pos]], n_states);
+    kernels.normalize(probs, n_states);
   }
 }
 
-void SequenceAlignment::fast_update_state_probs_tips(TreeNode* node, unsigned int pos, TreeNode* up_node) {
+void SequenceAlignment::fast_update_state_probs_tips(TreeNode* node, const std::vector<unsigned int>& positions, TreeNode* up_node) {
   /*
    * Only valid for tips - assumes only up node.
    * Equivilent of:
    * reset_to_base()
-   * update_state_probs(node, *pos, node->up->ancestral);
+   * update_state_probs(node, positions, node->up->ancestral);
    * NOTE we can assume there is an up node at a tip.
    */
+  const StateKernels::KernelSet& kernels = *state_kernels;
 
-  double u = node->SM->get_u();
-  double* state_probs = marginal_state_distribution[node->name][pos];
-  double* base_state_probs = prior_state_distribution[node->name][pos];
+  const TipPrior* prior = node_priors[node->index];
 
-  for(state_element state_j = 0; state_j < (state_element)n_states; state_j++) {
-    if(base_state_probs[state_j] != 0.0) {
-      state_probs[state_j] = base_state_probs[state_j] * find_state_prob_given_anc_branch(node->up, state_j, marginal_state_distribution[up_node->name][pos], node, u, pos);
-    } else {
-      state_probs[state_j] = 0.0;
+  Workspace& ws = workspace();
+  find_anc_messages(ws, node->up, up_node, positions, ws.up_messages);
+  for(unsigned int pos : positions) {
+    double* probs = marginal_at(node, pos);
+    const double* message = ws.up_messages[window_slot[pos]];
+
+    std::fill_n(probs, n_states, 0.0);
+    for(unsigned int e = prior->start[pos]; e < prior->start[pos+1]; e++) {
+      state_element state = prior->states[e];
+      probs[state] = prior->probs[e] * message[state];
     }
+    kernels.normalize(probs, n_states);
   }
 }
 
@@ -674,7 +940,7 @@ state_element SequenceAlignment::pick_state_from_probabilities(TreeNode* node, i
    * Picks a state from the marginal posterior distribution (taxa_names_to_state_probs).
    * Also resets the marginal posterior distribution to 0 or 1.
    */
-  double* probs = marginal_state_distribution[node->name][pos];
+  double* probs = marginal_at(node, pos);
 
   //state_element e = 0;
   //std::cout << node->name << " " << pos << " ";
@@ -722,19 +988,20 @@ state_element SequenceAlignment::pick_state_from_probabilities(TreeNode* node, i
 }
 
 void SequenceAlignment::pick_states_for_node(TreeNode* node, const std::list<unsigned int>& positions) {
-  std::vector<bool> gaps = taxa_names_to_gaps[node->name];
+  const std::vector<bool>& gaps = gaps_at(node);
+  std::vector<state_element>& sequence = sequence_at(node);
 
   for (const unsigned int pos : positions) {
     // Pick state from marginal distributions.
     if(gaps[pos]) {
-      taxa_names_to_sequences[node->name][pos] = -1;
+      sequence[pos] = -1;
     } else {
-      taxa_names_to_sequences[node->name][pos] = pick_state_from_probabilities(node, pos);
+      sequence[pos] = pick_state_from_probabilities(node, pos);
     }
   }
 }
 
-void SequenceAlignment::reconstruct_expand(const std::list<TreeNode*>& recursion_path, const std::list<unsigned int>& positions) {
+void SequenceAlignment::reconstruct_expand(const std::vector<TreeNode*>& recursion_path, const std::list<unsigned int>& positions) {
   /*
    * This function needs a better name.
    * This recalculates the marginal posteriors of each node and picks sequences, which again alters the posterior
@@ -748,15 +1015,8 @@ void SequenceAlignment::reconstruct_expand(const std::list<TreeNode*>& recursion
       // Tip Node.
       //reset_to_base(node->name, positions);
 
-      std::vector<bool> gaps = taxa_names_to_gaps[node->name];
-
-      for (unsigned int pos : positions) {
-        if(not gaps[pos]) {
-          //update_state_probs(node, *pos, node->up->ancestral);
-          fast_update_state_probs_tips(node, pos, node->up->ancestral);
-          normalize_state_probs(node, pos);
-        }
-      }
+      //update_state_probs(node, active_positions(node, positions), node->up->ancestral);
+      fast_update_state_probs_tips(node, active_positions(node, positions), node->up->ancestral);
     } else {
       // Internal Node.
       find_state_probs_all(node, positions);
@@ -766,83 +1026,130 @@ void SequenceAlignment::reconstruct_expand(const std::list<TreeNode*>& recursion
   }
 }
 
+// Split branches.
+void SequenceAlignment::find_state_probs_dec_only(SegmentedBranch* branch, const std::list<unsigned int>& positions) {
+  /*
+   * First recursion through the intermediate points of a split branch, from the bottom up.
+   * All the points share the gaps of the node below so the positions are checked once per branch.
+   */
+  std::vector<unsigned int> active = active_positions(branch->decendant, positions);
+
+  TreeNode* below = branch->decendant;
+  for(auto point = branch->points.rbegin(); point != branch->points.rend(); ++point) {
+    find_marginals(*point, active, below, nullptr, nullptr);
+    below = *point;
+  }
+}
+
+void SequenceAlignment::update_state_probs(SegmentedBranch* branch, const std::list<unsigned int>& positions, bool pickp) {
+  /*
+   * Second recursion through the intermediate points of a split branch, from the top down.
+   * If pickp the states of each point are picked before moving down to the next.
+   */
+  std::vector<unsigned int> active = active_positions(branch->decendant, positions);
+
+  for(TreeNode* point : branch->points) {
+    update_state_probs(point, active, point->up->ancestral);
+
+    if(pickp) pick_states_for_node(point, positions);
+  }
+}
+
 // SAMPLING AND RECURSION
 void SequenceAlignment::reverse_recursion(const std::list<unsigned int>& positions) {
   /* 
    * Initial reverse recurstion to start marginal posterior calculations of states at each node.
    * Starts at tips and works up the tree to the root.
    * Nodes are ordered in the list such that they are visted in order up the tree.
+   * With a single domain the pass only depends on the tip data, so it is run once per site pattern in the window.
    */ 
 
-  for(TreeNode* node : this->tree->nodes()) {
-    if(not node->isTip()) {
-      find_state_probs_dec_only(node, positions);
-    } else {
-      // This is important as states at tips can be uncertain.
-      reset_to_base(node->name, positions);
+  set_window(positions);
+  build_context_table(positions);
+
+  std::list<unsigned int> upward_positions = single_domainp ? pattern_representatives(positions) : positions;
+
+  const std::vector<std::vector<unsigned int>>& levels = tree->levels();
+  for(auto level = levels.rbegin(); level != levels.rend(); ++level) {
+    #pragma omp parallel for schedule(dynamic) if(level->size() >= traversal_grain)
+    for(unsigned int k = 0; k < level->size(); k++) {
+      dec_only_node((*level)[k], upward_positions);
     }
   }
+
+  if(single_domainp) copy_pattern_marginals(positions);
+}
+
+void SequenceAlignment::dec_only_node(unsigned int i, const std::list<unsigned int>& positions) {
+  /*
+   * First recursion at node i and the points on the branch above it, once the level below has been done.
+   * Nodes on the same level only read their own children so can be run in any order.
+   */
+  TreeNode* node = tree->node(i);
+  if(not node->isTip()) {
+    find_state_probs_dec_only(node, positions);
+  } else {
+    // This is important as states at tips can be uncertain.
+    reset_to_base(node, positions);
+  }
+
+  if(node->branch != nullptr and not node->branch->points.empty()) {
+    find_state_probs_dec_only(node->branch, positions);
+  }
+}
+
+void SequenceAlignment::update_node(unsigned int i, const std::list<unsigned int>& positions) {
+  /*
+   * Second recursion at node i and the points on the branch above it without picking states, once the level above
+   * has been done.
+   */
+  TreeNode* node = tree->node(i);
+
+  // Reculaculate state probability vector - including up branch.
+  TreeNode* up_node = node->up ? node->up->ancestral : nullptr;
+  if(up_node != nullptr) {
+    update_state_probs(node->branch, positions, false);
+    update_state_probs(node, active_positions(node, positions), up_node);
+  }
 }
 
 sample_status SequenceAlignment::sample_with_double_recursion(const std::list<unsigned int>& positions) {
   reverse_recursion(positions);
 
   // 2nd Recursion - Reverse recursion.
-  // Skip first element of reverse list as thats the root - no need to sample second time.
-  for (auto n = this->tree->nodes().rbegin(); n != this->tree->nodes().rend(); ++n) {
-    TreeNode* node = *n;
-    std::vector<bool> gaps = taxa_names_to_gaps[node->name];
+  // Root is only picked - no need to sample second time.
+  for (unsigned int i : this->tree->preorder()) {
+    TreeNode* node = this->tree->node(i);
 
     // Reculaculate state probability vector - including up branch.
     TreeNode* up_node = node->up ? node->up->ancestral : nullptr;
-
-    for (unsigned int pos : positions) {
-      // Note does not call for root node.
-      if((not gaps[pos]) and (up_node != nullptr)) {
-        update_state_probs(node, pos, up_node);
-        normalize_state_probs(node, pos);
-      }
+    if(up_node != nullptr) {
+      update_state_probs(node->branch, positions, true);
+      update_state_probs(node, active_positions(node, positions), up_node);
     }
 
     pick_states_for_node(node, positions);
   }
 
-  return(sample_status({false, true, true}));
+  return(sample_status({false, true, false}));
 }
 
 sample_status SequenceAlignment::sample_with_triple_recursion(const std::list<unsigned int>& positions) {
-  const std::list<TreeNode*> nodes = tree->nodes();
-
   reverse_recursion(positions);
 
   // 2nd Recursion - Reverse recursion.
-  // Skip first element of reverse list as thats the root - no need to sample second time.
-  for(auto n = nodes.rbegin(); n != nodes.rend(); ++n) {
-    TreeNode* node = *n;
-    std::vector<bool> gaps = taxa_names_to_gaps[node->name];
-
-    // Reculaculate state probability vector - including up branch.
-    TreeNode* up_node;
-    if(node->up) {
-      up_node = node->up->ancestral;
-    } else {
-      up_node = nullptr;
-    }
-
-    for(auto pos = positions.begin(); pos != positions.end(); ++pos) {
-      // Note does not call for root node.
-      if((not gaps[*pos]) and (not (up_node == nullptr))) {
-        update_state_probs(node, *pos, up_node);
-        normalize_state_probs(node, *pos);
-      }
-
+  // Root is skipped - no need to sample second time.
+  for(const std::vector<unsigned int>& level : tree->levels()) {
+    #pragma omp parallel for schedule(dynamic) if(level.size() >= traversal_grain)
+    for(unsigned int k = 0; k < level.size(); k++) {
+      update_node(level[k], positions);
     }
   }
 
   // 3rd Recursion - picking states.
   reconstruct_expand(tree->get_recursion_path(tree->rand_node()), positions);
 
-  return(sample_status({false, true, true}));
+  return(sample_status({false, true, false}));
 }
 
 // These functions are not critical they are useful though for other user who may not know how they are breaking simPLEX.
@@ -990,6 +1297,22 @@ std::string SequenceAlignmentParameter::get_state() {
   return("n/a");
 }
 
+unsigned int SequenceAlignmentParameter::get_sample_count() {
+  return(n_sample);
+}
+
+unsigned int SequenceAlignmentParameter::get_column_count() {
+  return(n_cols);
+}
+
+void SequenceAlignmentParameter::set_sample_count(unsigned int n_sample) {
+  if(n_sample < 1 or n_sample > n_cols) {
+    std::cerr << "Error: cannot sample " << n_sample << " from alignment with " << n_cols << " columms." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  this->n_sample = n_sample;
+}
+
 void SequenceAlignmentParameter::save_to_file(uint128_t gen, double l) {
   save_count += 1;
   msa->saveToFile(save_count, gen, l);
@@ -9,14 +9,18 @@
 #include <boost/multiprecision/cpp_int.hpp>
 
 #include "AbstractComponent.h"
+#include "../Matrix.h"
 #include "../IO/SequencesParser.h"
 #include "SubstitutionModels/States.h"
+#include "StateKernels.h"
 
 using boost::multiprecision::uint128_t;
 
 class Tree;
 class TreeNode;
 class BranchSegment;
+class SegmentedBranch;
+class RateVector;
 
 class SequenceAlignment { 
   public:
@@ -72,11 +76,16 @@ private:
   // Processing input sequences - fasta.
   std::vector<signed char> encode_sequence(const std::string &sequence);
 
-  // Probability distributions of each state.
-  // Taxa name -> residue position -> state -> probability.
-  // double** is a matrix where i is the sequence position and j is the state id.
-  std::map<std::string, double**> prior_state_distribution; // These are the priors.
-  std::map<std::string, double**> marginal_state_distribution;
+  // Probability distributions of each state at a tip, as a sparse (state, probability) list per position.
+  // Certain positions have a single entry with probability 1.0 and gaps have none.
+  struct TipPrior {
+    std::vector<unsigned int> start; // Position -> first entry, one longer than the sequence.
+    std::vector<state_element> states;
+    std::vector<double> probs;
+  };
+
+  // Taxa name -> prior.
+  std::map<std::string, TipPrior> prior_state_distribution; // These are the priors.
 
   // Sequences
   std::map<std::string, std::vector<state_element>> taxa_names_to_sequences;
@@ -84,27 +93,105 @@ private:
   // Gaps
   std::map<std::string, std::vector<bool>> taxa_names_to_gaps;
 
-  void reset_to_base(std::string name, const std::list<unsigned int>& positions);
-  void normalize_state_probs(const TreeNode* node, unsigned int pos);
+  // Storage for each tree node, indexed by TreeNode::index.
+  std::vector<const TipPrior*> node_priors; // Only set for tips.
+  std::vector<std::vector<bool>*> node_gaps;
+
+  // Intermediate points on split branches only hold states.
+  std::vector<std::vector<state_element>> point_sequences;
+
+  // Marginals are only kept for the positions in the current sweep.
+  Matrix<double> marginals; // Row (node/point, window slot), column state.
+  std::vector<unsigned int> window_slot; // column -> window slot.
+  unsigned int window_size;
+
+  void set_window(const std::list<unsigned int>& positions);
+
+  // Site patterns, the upward pass is shared by the positions with the same pattern in single domain models.
+  std::vector<unsigned int> column_pattern; // Column -> pattern.
+  unsigned int n_patterns;
+  std::vector<int> pattern_slot; // Pattern -> window slot of its representative, -1 outside a sweep.
+  void find_site_patterns();
+  std::list<unsigned int> pattern_representatives(const std::list<unsigned int>& positions);
+  void copy_pattern_marginals(const std::list<unsigned int>& positions);
+
+  double* marginal_at(const TreeNode* node, unsigned int pos);
+  const std::vector<bool>& gaps_at(const TreeNode* node);
+  std::vector<state_element>& sequence_at(const TreeNode* node);
+
+  void reset_to_base(TreeNode* node, const std::list<unsigned int>& positions);
+  std::vector<unsigned int> active_positions(const TreeNode* node, const std::list<unsigned int>& positions);
+
+  const StateKernels::KernelSet* state_kernels; // Picked for n_states.
+
+  // Transition probabilities for one position.
+  void transition_row(BranchSegment* branch, RateVector* rv, state_element state_i, double u, double* row);
+  double alt_domain_prob(BranchSegment* branch, state_element state_i, double u, unsigned int pos);
+
+
+  // Per sweep table of the contexts of each (segment, window slot), built at the start of reverse_recursion.
+  std::map<std::string, unsigned int> context_ids;
+  std::vector<RateVector*> context_rate_vectors; // Context id -> focal state.
+  bool single_domainp; // Only one state domain in the model.
+  std::vector<unsigned int> segment_contexts; // Segment -> window slot -> context id.
+  std::vector<unsigned int> segment_alt_entries; // Segment -> window slot -> entry in alt_probs.
+  std::vector<double> alt_probs; // Entry -> focal state.
+
+  std::string transition_context(BranchSegment* branch, unsigned int pos);
+  void build_context_table(const std::list<unsigned int>& positions);
+  unsigned int segment_context(const BranchSegment* branch, unsigned int pos);
+  const double* segment_alt_probs(const BranchSegment* branch, unsigned int pos);
+
+  // Scratch space for the messages, one per thread.
+  struct Workspace {
+    // Transition matrix of a branch segment shared by the positions with the same context in the other domains.
+    struct {
+      Matrix<double> P; // P[i][j] = probability of state j at the bottom given state i at the top.
+      Matrix<double> Pt; // Transpose of P.
+      const double* alt; // Contribution of the other domains given state i at the top.
+    } transitions;
+
+    std::vector<std::vector<unsigned int>> position_groups; // Context id -> positions.
+    std::vector<unsigned int> used_contexts; // Ids with positions in the current groups.
+
+    // Messages for the whole window, rows indexed by window slot.
+    Matrix<double> stacked_rows;
+    Matrix<double> product_rows;
+    Matrix<double> left_messages;
+    Matrix<double> right_messages;
+    Matrix<double> up_messages;
+  };
+  std::vector<Workspace> workspaces;
+  Workspace& workspace();
 
-  // Marginal Calculations for indervidual positions.
-  double find_state_prob_given_dec_branch(BranchSegment* branch, state_element state_i, double* state_probs, std::vector<Valuable*> rv, double u, unsigned int pos);
-  double find_state_prob_given_anc_branch(BranchSegment* branch, state_element state_i, double* state_probs, TreeNode* node, double u, unsigned int pos);
-  void find_marginal_at_pos(TreeNode*, unsigned int, TreeNode*, TreeNode*, TreeNode*);
+  void group_positions(Workspace& ws, BranchSegment* branch, const std::vector<unsigned int>& positions, const std::vector<bool>& gaps);
+  void build_transitions(Workspace& ws, BranchSegment* branch, unsigned int pos, double u);
+  void find_dec_messages(Workspace& ws, BranchSegment* branch, const TreeNode* child, const std::vector<unsigned int>& positions, Matrix<double>& messages);
+  void find_anc_messages(Workspace& ws, BranchSegment* branch, const TreeNode* parent, const std::vector<unsigned int>& positions, Matrix<double>& messages);
+  void find_marginals(TreeNode* node, const std::vector<unsigned int>& positions, TreeNode* left_node, TreeNode* right_node, TreeNode* up_node);
 
   // Marginal posterior calculations for whole sequences.
-  void find_state_probs_dec_only(TreeNode*, std::list<unsigned int>); // First Recursion.
-  void update_state_probs(TreeNode* node, unsigned int pos, TreeNode* up_node); // Second Recursion
-  void find_state_probs_all(TreeNode*, std::list<unsigned int>); // Third Recursion
+  void find_state_probs_dec_only(TreeNode*, const std::list<unsigned int>&); // First Recursion.
+  void update_state_probs(TreeNode* node, const std::vector<unsigned int>& positions, TreeNode* up_node); // Second Recursion
+  void find_state_probs_all(TreeNode*, const std::list<unsigned int>&); // Third Recursion
+
+  // Passing through the intermediate points of split branches.
+  void find_state_probs_dec_only(SegmentedBranch*, const std::list<unsigned int>&); // First Recursion.
+  void update_state_probs(SegmentedBranch*, const std::list<unsigned int>&, bool pickp); // Second Recursion
+
+  // Traversal level by level, nodes on a level are run in parallel if there are at least traversal_grain of them.
+  unsigned int traversal_grain;
+  void dec_only_node(unsigned int node_index, const std::list<unsigned int>&); // First Recursion.
+  void update_node(unsigned int node_index, const std::list<unsigned int>&); // Second Recursion
 
   // Optimize
-  void fast_update_state_probs_tips(TreeNode* node, unsigned int pos, TreeNode* up_node); // Second Recursion
+  void fast_update_state_probs_tips(TreeNode* node, const std::vector<unsigned int>& positions, TreeNode* up_node); // Second Recursion
 
   // Picking states
   state_element pick_state_from_probabilities(TreeNode*, int);
   void pick_states_for_node(TreeNode*, const std::list<unsigned int>&);
 
-  void reconstruct_expand(const std::list<TreeNode*>&, const std::list<unsigned int>&);
+  void reconstruct_expand(const std::vector<TreeNode*>&, const std::list<unsigned int>&);
 
   // Outputs
   std::string seqs_out_identifier;
@@ -138,6 +225,11 @@ public:
   std::string get_state_header() override;
   std::string get_state() override;
 
+  // Window of positions sampled each time.
+  unsigned int get_sample_count();
+  unsigned int get_column_count();
+  void set_sample_count(unsigned int n_sample);
+
   void save_to_file(uint128_t gen, double l);
 };
 
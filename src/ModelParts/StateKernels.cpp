@@ -0,0 +1,362 @@
+/*
+ * STATE KERNELS
+ * Vectorised operations on the state probability vectors.
+ * The portable versions are plain loops. The AVX2 and AVX-512 versions are compiled with
+ * function level target attributes so the rest of the program does not need to be built
+ * for those instruction sets, and are only used if the CPU reports support at runtime.
+ * Every kernel is a template on the number of states, N = 0 takes the count at runtime.
+ * The fixed sizes let the compiler unroll the loops completely while keeping the same
+ * order of operations, so results do not depend on which size is used.
+ */
+
+#include "StateKernels.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STATE_KERNELS_X86
+#endif
+
+namespace StateKernels {
+  // Portable.
+  template<unsigned int N>
+  double dot_portable(const double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    double total = 0.0;
+    for(unsigned int i = 0; i < n; i++) total += a[i] * b[i];
+    return(total);
+  }
+
+  template<unsigned int N>
+  void axpy_portable(double alpha, const double* x, double* y, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    for(unsigned int i = 0; i < n; i++) y[i] += alpha * x[i];
+  }
+
+  template<unsigned int N>
+  void multiply_portable(double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    for(unsigned int i = 0; i < n; i++) a[i] *= b[i];
+  }
+
+  template<unsigned int N>
+  void multiply_to_portable(double* out, const double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    for(unsigned int i = 0; i < n; i++) out[i] = a[i] * b[i];
+  }
+
+  template<unsigned int N>
+  double normalize_portable(double* a, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    double total = 0.0;
+    for(unsigned int i = 0; i < n; i++) total += a[i];
+
+    if(total != 0.0) {
+      for(unsigned int i = 0; i < n; i++) a[i] /= total;
+    }
+    return(total);
+  }
+
+  void virtual_draws_portable(const double* rates, const double* uniforms, double t, std::uint64_t* hits, unsigned int n) {
+    for(unsigned int w = 0; w * 64 < n; w++) {
+      std::uint64_t word = 0;
+      unsigned int end = std::min(n, w * 64 + 64);
+      for(unsigned int i = w * 64; i < end; i++) {
+	double p = 1.0 - (1.0 / (1.0 + rates[i] * t));
+	if(uniforms[i] < p) word |= std::uint64_t(1) << (i - w * 64);
+      }
+      hits[w] = word;
+    }
+  }
+
+#ifdef STATE_KERNELS_X86
+  // AVX2 - 4 doubles per register.
+  template<unsigned int N>
+  __attribute__((target("avx2,fma")))
+  double dot_avx2(const double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    __m256d acc = _mm256_setzero_pd();
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4) {
+      acc = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc);
+    }
+
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double total = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for(; i < n; i++) total += a[i] * b[i];
+    return(total);
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx2,fma")))
+  void axpy_avx2(double alpha, const double* x, double* y, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    __m256d va = _mm256_set1_pd(alpha);
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    }
+    for(; i < n; i++) y[i] += alpha * x[i];
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx2")))
+  void multiply_avx2(double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for(; i < n; i++) a[i] *= b[i];
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx2")))
+  void multiply_to_avx2(double* out, const double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4) {
+      _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for(; i < n; i++) out[i] = a[i] * b[i];
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx2")))
+  double normalize_avx2(double* a, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    __m256d acc = _mm256_setzero_pd();
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4) acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));
+
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double total = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for(; i < n; i++) total += a[i];
+
+    if(total != 0.0) {
+      __m256d vt = _mm256_set1_pd(total);
+      for(i = 0; i + 4 <= n; i += 4) {
+	_mm256_storeu_pd(a + i, _mm256_div_pd(_mm256_loadu_pd(a + i), vt));
+      }
+      for(; i < n; i++) a[i] /= total;
+    }
+    return(total);
+  }
+
+  // No fused multiply-add, so the probabilities round the same way as the portable version.
+  __attribute__((target("avx2")))
+  void virtual_draws_avx2(const double* rates, const double* uniforms, double t, std::uint64_t* hits, unsigned int n) {
+    __m256d vt = _mm256_set1_pd(t);
+    __m256d one = _mm256_set1_pd(1.0);
+    for(unsigned int w = 0; w * 64 < n; w++) {
+      std::uint64_t word = 0;
+      unsigned int end = std::min(n, w * 64 + 64);
+      unsigned int i = w * 64;
+      for(; i + 4 <= end; i += 4) {
+	__m256d p = _mm256_sub_pd(one, _mm256_div_pd(one, _mm256_add_pd(one, _mm256_mul_pd(_mm256_loadu_pd(rates + i), vt))));
+	std::uint64_t mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(uniforms + i), p, _CMP_LT_OQ));
+	word |= mask << (i - w * 64);
+      }
+      for(; i < end; i++) {
+	double p = 1.0 - (1.0 / (1.0 + rates[i] * t));
+	if(uniforms[i] < p) word |= std::uint64_t(1) << (i - w * 64);
+      }
+      hits[w] = word;
+    }
+  }
+
+  // AVX-512 - 8 doubles per register, tails handled with masks.
+  template<unsigned int N>
+  __attribute__((target("avx512f")))
+  double dot_avx512(const double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    __m512d acc = _mm512_setzero_pd();
+    unsigned int i = 0;
+    for(; i + 8 <= n; i += 8) {
+      acc = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), acc);
+    }
+    if(i < n) {
+      __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+      acc = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, a + i), _mm512_maskz_loadu_pd(m, b + i), acc);
+    }
+    return(_mm512_reduce_add_pd(acc));
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx512f")))
+  void axpy_avx512(double alpha, const double* x, double* y, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    __m512d va = _mm512_set1_pd(alpha);
+    unsigned int i = 0;
+    for(; i + 8 <= n; i += 8) {
+      _mm512_storeu_pd(y + i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+    }
+    if(i < n) {
+      __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+      __m512d vy = _mm512_fmadd_pd(va, _mm512_maskz_loadu_pd(m, x + i), _mm512_maskz_loadu_pd(m, y + i));
+      _mm512_mask_storeu_pd(y + i, m, vy);
+    }
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx512f")))
+  void multiply_avx512(double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    unsigned int i = 0;
+    for(; i + 8 <= n; i += 8) {
+      _mm512_storeu_pd(a + i, _mm512_mul_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    }
+    if(i < n) {
+      __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+      _mm512_mask_storeu_pd(a + i, m, _mm512_mul_pd(_mm512_maskz_loadu_pd(m, a + i), _mm512_maskz_loadu_pd(m, b + i)));
+    }
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx512f")))
+  void multiply_to_avx512(double* out, const double* a, const double* b, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    unsigned int i = 0;
+    for(; i + 8 <= n; i += 8) {
+      _mm512_storeu_pd(out + i, _mm512_mul_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    }
+    if(i < n) {
+      __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+      _mm512_mask_storeu_pd(out + i, m, _mm512_mul_pd(_mm512_maskz_loadu_pd(m, a + i), _mm512_maskz_loadu_pd(m, b + i)));
+    }
+  }
+
+  template<unsigned int N>
+  __attribute__((target("avx512f")))
+  double normalize_avx512(double* a, unsigned int n_states) {
+    const unsigned int n = N ? N : n_states;
+    __m512d acc = _mm512_setzero_pd();
+    unsigned int i = 0;
+    for(; i + 8 <= n; i += 8) acc = _mm512_add_pd(acc, _mm512_loadu_pd(a + i));
+    __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+    if(i < n) acc = _mm512_add_pd(acc, _mm512_maskz_loadu_pd(m, a + i));
+    double total = _mm512_reduce_add_pd(acc);
+
+    if(total != 0.0) {
+      __m512d vt = _mm512_set1_pd(total);
+      for(i = 0; i + 8 <= n; i += 8) {
+	_mm512_storeu_pd(a + i, _mm512_div_pd(_mm512_loadu_pd(a + i), vt));
+      }
+      if(i < n) _mm512_mask_storeu_pd(a + i, m, _mm512_div_pd(_mm512_maskz_loadu_pd(m, a + i), vt));
+    }
+    return(total);
+  }
+
+  __attribute__((target("avx512f")))
+  void virtual_draws_avx512(const double* rates, const double* uniforms, double t, std::uint64_t* hits, unsigned int n) {
+    __m512d vt = _mm512_set1_pd(t);
+    __m512d one = _mm512_set1_pd(1.0);
+    for(unsigned int w = 0; w * 64 < n; w++) {
+      std::uint64_t word = 0;
+      unsigned int end = std::min(n, w * 64 + 64);
+      for(unsigned int i = w * 64; i < end; i += 8) {
+	__mmask8 m = (end - i >= 8) ? 0xFF : (__mmask8)((1u << (end - i)) - 1);
+	__m512d p = _mm512_sub_pd(one, _mm512_div_pd(one, _mm512_add_pd(one, _mm512_mul_pd(_mm512_maskz_loadu_pd(m, rates + i), vt))));
+	std::uint64_t mask = _mm512_mask_cmp_pd_mask(m, _mm512_maskz_loadu_pd(m, uniforms + i), p, _CMP_LT_OQ);
+	word |= mask << (i - w * 64);
+      }
+      hits[w] = word;
+    }
+  }
+#endif
+
+  template<unsigned int N>
+  KernelSet portable_kernels() {
+    return(KernelSet{"portable", dot_portable<N>, axpy_portable<N>, multiply_portable<N>, multiply_to_portable<N>, normalize_portable<N>, virtual_draws_portable});
+  }
+#ifdef STATE_KERNELS_X86
+  template<unsigned int N>
+  KernelSet avx2_kernels() {
+    return(KernelSet{"AVX2", dot_avx2<N>, axpy_avx2<N>, multiply_avx2<N>, multiply_to_avx2<N>, normalize_avx2<N>, virtual_draws_avx2});
+  }
+
+  template<unsigned int N>
+  KernelSet avx512_kernels() {
+    return(KernelSet{"AVX-512", dot_avx512<N>, axpy_avx512<N>, multiply_avx512<N>, multiply_to_avx512<N>, normalize_avx512<N>, virtual_draws_avx512});
+  }
+#endif
+
+  // Binary hidden states, nucleotides, amino acids and codons.
+  template<template<unsigned int> class Sizes>
+  std::map<unsigned int, KernelSet> fixed_kernels() {
+    return(std::map<unsigned int, KernelSet>{{2, Sizes<2>::get()}, {4, Sizes<4>::get()}, {20, Sizes<20>::get()}, {61, Sizes<61>::get()}});
+  }
+
+  template<unsigned int N> struct PortableSizes { static KernelSet get() { return(portable_kernels<N>()); } };
+#ifdef STATE_KERNELS_X86
+  template<unsigned int N> struct AVX2Sizes { static KernelSet get() { return(avx2_kernels<N>()); } };
+  template<unsigned int N> struct AVX512Sizes { static KernelSet get() { return(avx512_kernels<N>()); } };
+#endif
+
+  static KernelSet active = portable_kernels<0>();
+  static std::map<unsigned int, KernelSet> active_fixed = fixed_kernels<PortableSizes>();
+
+  bool supports(std::string option) {
+#ifdef STATE_KERNELS_X86
+    __builtin_cpu_init();
+    if(option == "avx512") return(__builtin_cpu_supports("avx512f"));
+    if(option == "avx2") return(__builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma"));
+#endif
+    return(option == "portable");
+  }
+
+  void select(std::string option) {
+    if(option == "auto") {
+      if(supports("avx512")) {
+	option = "avx512";
+      } else if(supports("avx2")) {
+	option = "avx2";
+      } else {
+	option = "portable";
+      }
+    }
+
+    if(option != "avx512" and option != "avx2" and option != "portable") {
+      std::cerr << "Error: state kernels \"" << option << "\" not recognized. Options are auto, avx512, avx2 or portable." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    if(not supports(option)) {
+      std::cerr << "Error: state kernels \"" << option << "\" are not supported on this CPU." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+#ifdef STATE_KERNELS_X86
+    if(option == "avx512") {
+      active = avx512_kernels<0>();
+      active_fixed = fixed_kernels<AVX512Sizes>();
+    }
+    if(option == "avx2") {
+      active = avx2_kernels<0>();
+      active_fixed = fixed_kernels<AVX2Sizes>();
+    }
+#endif
+    if(option == "portable") {
+      active = portable_kernels<0>();
+      active_fixed = fixed_kernels<PortableSizes>();
+    }
+  }
+
+  const KernelSet& get() {
+    return(active);
+  }
+
+  const KernelSet& get(unsigned int n_states) {
+    auto it = active_fixed.find(n_states);
+    if(it == active_fixed.end()) return(active);
+    return(it->second);
+  }
+
+  bool fixedp(unsigned int n_states) {
+    return(active_fixed.count(n_states) != 0);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef StateKernels_h_
+#define StateKernels_h_
+
+#include <string>
+#include <cstdint>
+
+// Dense operations on state vectors used by the ancestral state recursions,
+// and the batched virtual substitution draws of the branch segments.
+// Each operation has a portable version and, on x86, AVX2 and AVX-512 versions.
+// The fastest version supported by the CPU is picked at runtime.
+// There are also versions for a fixed number of states, for the common state spaces.
+namespace StateKernels {
+  struct KernelSet {
+    std::string name;
+
+    double (*dot)(const double* a, const double* b, unsigned int n); // Sum of a[i] * b[i].
+    void (*axpy)(double alpha, const double* x, double* y, unsigned int n); // y[i] += alpha * x[i].
+    void (*multiply)(double* a, const double* b, unsigned int n); // a[i] *= b[i].
+    void (*multiply_to)(double* out, const double* a, const double* b, unsigned int n); // out[i] = a[i] * b[i].
+    double (*normalize)(double* a, unsigned int n); // Divides by the total if it is not 0.0, returns the total.
+    // Bit i of hits (packed 64 per word) is set if uniforms[i] < 1 - 1 / (1 + rates[i] * t).
+    void (*virtual_draws)(const double* rates, const double* uniforms, double t, std::uint64_t* hits, unsigned int n);
+  };
+
+  // Picks the kernels. Option is one of "auto", "avx512", "avx2" or "portable".
+  void select(std::string option);
+  const KernelSet& get(); // Any number of states.
+  const KernelSet& get(unsigned int n_states); // Fixed size kernels for n_states if there are some, otherwise get().
+  bool fixedp(unsigned int n_states);
+}
+
+#endif
@@ -1,7 +1,13 @@
 #include <stdlib.h> //This gives rand.
 #include <limits>
+#include <algorithm>
+#include <cmath>
 
 #include "Parameters.h"
+#include "../../Environment.h"
+
+extern Environment env;
+extern UndoLog undo_log;
 
 // CONTINUOUS FLOAT
 
@@ -11,6 +17,12 @@ ContinuousFloat::ContinuousFloat(std::string name, double initial_value = 0.0, d
    */
 
   previous_value = initial_value;
+
+  tries = env.get_or<int>("MCMC.multiple_tries", 1);
+  if(tries < 1) {
+    std::cerr << "Error: multiple_tries must be at least 1." << std::endl;
+    exit(EXIT_FAILURE);
+  }
 }
 
 void ContinuousFloat::print() {
@@ -23,23 +35,107 @@ sample_status ContinuousFloat::sample() {
   previous_value = value;
   fixedQ = false;
 
-  double r = ((rand() % 10000) / 10000.0) - 0.5;
-  value = value + (r * std_dev);
-
+  // Reflecting within the values that keep the virtual rates in bounds as well as the constraints.
   double lb = lower_bound->get_value();
   double ub = upper_bound->get_value();
+  virtual_bounds.narrow(this, lb, ub);
+
+  if(ub <= lb) {
+    // No room to move.
+    return(sample_status({true, true, false}));
+  }
+
+  if(tries > 1) return(sample_multiple_try(lb, ub));
+
+  value = propose(value, lb, ub);
+
+  return(sample_status({true, true, false}));
+}
+
+double ContinuousFloat::propose(double from, double lb, double ub) {
+  double r = ((rand() % 10000) / 10000.0) - 0.5;
+  double to = from + (r * std_dev);
 
-  while(value < lb or value > ub) {
-    if(value < lb) {
-      value = (2*lb) - value;
+  while(to < lb or to > ub) {
+    if(to < lb) {
+      to = (2*lb) - to;
     }
 
-    if(value > ub) {
-      value = (2*ub) - value;
+    if(to > ub) {
+      to = (2*ub) - to;
     }
   }
 
-  return(sample_status({true, true, false}));
+  return(to);
+}
+
+sample_status ContinuousFloat::sample_multiple_try(double lb, double ub) {
+  /*
+   * Multiple-try Metropolis (Liu, Liang and Wong 2000). Candidates are drawn around the current value and one is
+   * picked by likelihood, then reference points are drawn around the pick, with the current value as the last one.
+   * The reflected step is symmetric and the bounds do not depend on the current value, so the likelihoods are the
+   * weights and the step is accepted with the ratio of the total weights of the two sets.
+   * Each set is scored in one batch over the locations this parameter changes.
+   */
+  double x = value;
+  double neg_inf = -std::numeric_limits<double>::infinity();
+
+  auto score = [&](const std::vector<double>& points, unsigned int n, std::vector<double>& changes) {
+    std::vector<bool> feasible(n, true);
+    LikelihoodHooks::changes(n, [&](unsigned int c) {
+      set_value(points[c]);
+      for(AbstractComponent* d : get_refresh_list()) d->refresh();
+      feasible[c] = virtual_bounds.in_boundsp();
+    }, changes);
+    for(unsigned int c = 0; c < n; c++) {
+      if(not feasible[c]) changes[c] = neg_inf;
+    }
+  };
+
+  // Log of the sum of exp(changes), which are relative to the current likelihood.
+  auto log_total = [&](const std::vector<double>& changes) {
+    double max_change = *std::max_element(changes.begin(), changes.end());
+    if(max_change == neg_inf) return(neg_inf);
+    double total = 0.0;
+    for(double change : changes) total += exp(change - max_change);
+    return(max_change + log(total));
+  };
+
+  std::vector<double> candidates(tries);
+  for(unsigned int c = 0; c < tries; c++) candidates[c] = propose(x, lb, ub);
+  std::vector<double> changes;
+  score(candidates, tries, changes);
+
+  double log_candidates = log_total(changes);
+  if(log_candidates == neg_inf) {
+    // Every candidate pushes a virtual rate out of bounds.
+    set_value(x);
+    return(sample_status({false, false, false}));
+  }
+
+  // Picking a candidate by weight.
+  std::vector<double> weights(tries);
+  for(unsigned int c = 0; c < tries; c++) weights[c] = exp(changes[c] - log_candidates);
+
+  double r = (rand() % 10000) / 10000.0;
+  unsigned int j = 0;
+  while(j < tries - 1 and r >= weights[j]) {
+    r -= weights[j];
+    j++;
+  }
+  while(weights[j] == 0.0) j--; // Rounding past the last candidate with weight.
+  double y = candidates[j];
+  double change_y = changes[j];
+
+  std::vector<double> references(tries);
+  for(unsigned int c = 0; c < tries - 1; c++) references[c] = propose(y, lb, ub);
+  std::vector<double> reference_changes;
+  score(references, tries - 1, reference_changes);
+  reference_changes.push_back(0.0); // The current value.
+
+  set_value(y);
+
+  return(sample_status({true, true, false, log_candidates - log_total(reference_changes) - change_y}));
 }
 
 const double& ContinuousFloat::get_value() {
@@ -63,6 +159,30 @@ void ContinuousFloat::fix() {
 void ContinuousFloat::refresh() {
 }
 
+void ContinuousFloat::setup_virtual_bounds() {
+  virtual_bounds.setup(this);
+}
+
+double ContinuousFloat::get_step_size() {
+  return(std_dev);
+}
+
+bool ContinuousFloat::fixed_boundsp() {
+  return(dynamic_cast<DynamicConstraint*>(lower_bound) == nullptr and dynamic_cast<DynamicConstraint*>(upper_bound) == nullptr);
+}
+
+double ContinuousFloat::get_lower_bound() {
+  return(lower_bound->get_value());
+}
+
+double ContinuousFloat::get_upper_bound() {
+  return(upper_bound->get_value());
+}
+
+void ContinuousFloat::set_value(double new_value) {
+  undo_log.write(value, previous_value, log_stamp, new_value);
+}
+
 std::string ContinuousFloat::get_state_header() {
   return(name);
 }
@@ -80,6 +200,79 @@ std::ostream& operator<<(std::ostream& os, const ContinuousFloat& cf) {
   return(os);
 }
 
+// CONTINUOUS SLICE
+
+ContinuousSlice::ContinuousSlice(std::string name, double initial_value, double step_size, unsigned int max_steps) : ContinuousFloat(name, initial_value, step_size), max_steps(max_steps) {
+}
+
+double ContinuousSlice::trial(double x) {
+  value = x;
+  for(AbstractComponent* c : get_refresh_list()) c->refresh();
+
+  if(not virtual_bounds.in_boundsp()) return(-std::numeric_limits<double>::infinity());
+
+  return(LikelihoodHooks::change());
+}
+
+sample_status ContinuousSlice::sample() {
+  /*
+   * Slice sampling with stepping out and shrinkage (Neal 2003), on the log likelihood relative to the current value.
+   * The slice is limited to the constraints and to the values that keep the linear virtual rates in bounds.
+   */
+  previous_value = value;
+  fixedQ = false;
+
+  double x0 = value;
+  double lb = lower_bound->get_value();
+  double ub = upper_bound->get_value();
+  virtual_bounds.narrow(this, lb, ub);
+  if(ub <= lb) {
+    // No room to move.
+    return(sample_status({false, false, false}));
+  }
+
+  // Height of the slice, below the current log likelihood by an exponential draw.
+  double y = log((rand() % 10000 + 1) / 10001.0);
+
+  // Stepping out, splitting the steps randomly between the two sides.
+  double left = x0 - std_dev * ((rand() % 10000) / 10000.0);
+  double right = left + std_dev;
+  unsigned int j = rand() % max_steps;
+  unsigned int k = max_steps - 1 - j;
+  while(j > 0 and left > lb and trial(left) > y) {
+    left -= std_dev;
+    j--;
+  }
+  while(k > 0 and right < ub and trial(right) > y) {
+    right += std_dev;
+    k--;
+  }
+  left = std::max(left, lb);
+  right = std::min(right, ub);
+
+  // Shrinking towards the current value until a point inside the slice is drawn.
+  for(int n = 0; n < 200; n++) {
+    double x1 = left + ((rand() % 10000) / 10000.0) * (right - left);
+    if(trial(x1) >= y) {
+      return(sample_status({false, true, false}));
+    }
+
+    if(x1 < x0) {
+      left = x1;
+    } else {
+      right = x1;
+    }
+  }
+
+  // Only reached through rounding, stay put.
+  trial(x0);
+  return(sample_status({false, true, false}));
+}
+
+std::string ContinuousSlice::get_type() {
+  return("CONTINUOUS_SLICE");
+}
+
 // DISCRETE FLOAT
 RateCategories::RateCategories(std::string name, std::vector<Valuable*> categories) : AbstractComponent(name) {
   values = categories;
@@ -138,6 +331,10 @@ double RateCategories::operator[](int i) {
   return(values[i]->get_value());
 }
 
+Valuable* RateCategories::get_category(int i) {
+  return(values[i]);
+}
+
 std::string RateCategories::get_type() {
   return("RATE_CATEGORIES");
 }
@@ -161,31 +358,51 @@ void DiscreteFloat::print() {
 }
 
 sample_status DiscreteFloat::sample() {
+  /*
+   * Gibbs update over all the categories, each is weighted by its likelihood.
+   * Categories that push a virtual rate out of bounds have no weight, the current category always has some.
+   */
   fixedQ = false;
 
   prev_i = i;
 
-  if(i == 0) {
-    i = 1;
-  } else if(i == n-1) {
-    i = i - 1;
-  } else {
-    int r  = rand() % 2;
-    if(r == 0) {
-      i = i - 1;
-    } else {
-      i = i + 1;
-    }
+  std::vector<bool> feasible(n, true);
+  std::vector<double> changes(n, 0.0);
+  LikelihoodHooks::changes(n, [&](unsigned int c) {
+    i = c;
+    undo_log.write(value, previous_value, log_stamp, (*rc)[i]);
+    for(AbstractComponent* d : get_refresh_list()) d->refresh();
+    feasible[c] = virtual_bounds.in_boundsp();
+  }, changes);
+
+  double max_change = changes[prev_i];
+  for(int c = 0; c < n; c++) {
+    if(feasible[c]) max_change = std::max(max_change, changes[c]);
   }
 
-  value = (*rc)[i];
+  std::vector<double> weights(n, 0.0);
+  double total = 0.0;
+  for(int c = 0; c < n; c++) {
+    if(feasible[c] or c == prev_i) weights[c] = exp(changes[c] - max_change);
+    total += weights[c];
+  }
+
+  double r = ((rand() % 10000) / 10000.0) * total;
+  i = 0;
+  while(i < n - 1 and r >= weights[i]) {
+    r -= weights[i];
+    i++;
+  }
+  while(weights[i] == 0.0) i--; // Rounding past the last category with weight.
+
+  undo_log.write(value, previous_value, log_stamp, (*rc)[i]);
 
   if(value == 0) {
     std::cerr << "Error: attempted sampling to a category at a value equal to 0.0" << std::endl;
     exit(EXIT_FAILURE);
   }
   
-  return(sample_status({true, true, false}));
+  return(sample_status({false, true, false}));
 }
 
 const double& DiscreteFloat::get_value() {
@@ -210,7 +427,7 @@ void DiscreteFloat::fix() {
 }
 
 void DiscreteFloat::refresh() {
-    value = (*rc)[i];
+  undo_log.write(value, previous_value, log_stamp, (*rc)[i]);
 }
 
 std::string DiscreteFloat::get_state_header() {
@@ -225,6 +442,15 @@ std::string DiscreteFloat::get_type() {
   return("DISCRETE_FLOAT");
 }
 
+void DiscreteFloat::setup_virtual_bounds() {
+  virtual_bounds.setup(this);
+}
+
+double DiscreteFloat::slope(Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear) {
+  // Only the current category moves with the parameter.
+  return(value_slope(rc->get_category(i), parameter, dependents, linear));
+}
+
 // FIXED FLOAT
 
 FixedFloat::FixedFloat(std::string parameter_name, double v) : NonSampleableValue(parameter_name) {
@@ -344,13 +570,32 @@ void Arithmatic::fix() {
 }
 
 void Arithmatic::refresh() {
-  value = arith_func(v1->get_value(), v2->get_value());
+  undo_log.write(value, previous_value, log_stamp, arith_func(v1->get_value(), v2->get_value()));
 }
 
 std::string Arithmatic::get_type() {
   return("ARITHMATIC");
 }
 
+double Arithmatic::slope(Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear) {
+  double d1 = value_slope(v1, parameter, dependents, linear);
+  double d2 = value_slope(v2, parameter, dependents, linear);
+
+  switch(op) {
+  case ADDITION:
+    return(d1 + d2);
+  case SUBTRACTION:
+    return(d1 - d2);
+  case MULTIPLICATION:
+    if(d1 != 0.0 and d2 != 0.0) linear = false;
+    return(d1 * v2->get_value() + v1->get_value() * d2);
+  case DIVISION:
+    if(d2 != 0.0) linear = false;
+    return((d1 * v2->get_value() - v1->get_value() * d2) / (v2->get_value() * v2->get_value()));
+  }
+  return(0.0);
+}
+
 // DEPENDENCY GROUPS
 
 DependencyGroup::DependencyGroup(std::string name) : AbstractComponent(name) {
@@ -464,12 +709,19 @@ void VirtualSubstitutionRate::refresh() {
   }
   //std::cout << "]" << std::endl;
   
-  value = u->get_value() - total;
+  undo_log.write(value, previous_value, log_stamp, u->get_value() - total);
+}
 
-  //std::cout << previous_value << "->" << value << std::endl;
-  if(value <= 0.0 || value > 1.0) {
-    throw OutOfBoundsException("VirtualSubstitutionRate out of bounds.");
+bool VirtualSubstitutionRate::in_boundsp() {
+  return(value > 0.0 and value <= 1.0);
+}
+
+double VirtualSubstitutionRate::slope(Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear) {
+  double total = value_slope(u, parameter, dependents, linear);
+  for(Valuable* rate : dependent_rates) {
+    total -= value_slope(rate, parameter, dependents, linear);
   }
+  return(total);
 }
 
 void VirtualSubstitutionRate::add_rate(Valuable* v) {
@@ -493,3 +745,62 @@ void VirtualSubstitutionRate::set_u(Valuable *unif) {
   }
 }
 
+
+// VIRTUAL RATE BOUNDS
+
+double value_slope(Valuable* value, Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear) {
+  if(value == parameter) return(1.0);
+
+  AbstractComponent* component = dynamic_cast<AbstractComponent*>(value);
+  if(component == nullptr or dependents.find(component) == dependents.end()) {
+    // Not refreshed by the parameter.
+    return(0.0);
+  }
+
+  if(Arithmatic* a = dynamic_cast<Arithmatic*>(value)) return(a->slope(parameter, dependents, linear));
+  if(VirtualSubstitutionRate* v = dynamic_cast<VirtualSubstitutionRate*>(value)) return(v->slope(parameter, dependents, linear));
+  if(DiscreteFloat* d = dynamic_cast<DiscreteFloat*>(value)) return(d->slope(parameter, dependents, linear));
+
+  // Anything else, such as the uniformization constant, is left to the check after the refresh.
+  linear = false;
+  return(0.0);
+}
+
+void VirtualRateBounds::setup(SampleableValue* parameter) {
+  rates = {};
+  dependents = {};
+  for(AbstractComponent* c : parameter->get_refresh_list()) {
+    if(not dependents.insert(c).second) continue; // The refresh list has duplicates.
+    VirtualSubstitutionRate* rate = dynamic_cast<VirtualSubstitutionRate*>(c);
+    if(rate != nullptr) rates.push_back(rate);
+  }
+}
+
+void VirtualRateBounds::narrow(Valuable* parameter, double& lower, double& upper) {
+  /*
+   * A linear rate at value v with slope c is v + c (x' - x) when the parameter moves from x to x',
+   * which is within (0, 1] between x - v/c and x + (1 - v)/c.
+   */
+  double x = parameter->get_value();
+  for(VirtualSubstitutionRate* rate : rates) {
+    bool linear = true;
+    double c = rate->slope(parameter, dependents, linear);
+    if(not linear or c == 0.0) continue;
+
+    double v = rate->get_value();
+    double zero = x - v / c;
+    double one = x + (1.0 - v) / c;
+    lower = std::max(lower, std::min(zero, one));
+    upper = std::min(upper, std::max(zero, one));
+  }
+}
+
+bool VirtualRateBounds::in_boundsp() {
+  for(VirtualSubstitutionRate* rate : rates) {
+    if(not rate->in_boundsp()) return(false);
+  }
+  return(true);
+}
+
+std::function<double()> LikelihoodHooks::change = nullptr;
+std::function<void(unsigned int, const std::function<void(unsigned int)>&, std::vector<double>&)> LikelihoodHooks::changes = nullptr;
@@ -5,9 +5,35 @@
 
 #include <string>
 #include <list>
+#include <set>
 #include <iostream>
-#include <exception>
 #include <vector>
+#include <functional>
+
+class VirtualSubstitutionRate;
+
+// Virtual substitution rates must stay within (0, 1].
+// Those that are linear in a parameter bound it, so proposals can be kept in bounds before anything is refreshed.
+// The others are only checked after the refresh.
+struct VirtualRateBounds {
+  std::vector<VirtualSubstitutionRate*> rates; // Virtual rates that depend on the parameter.
+  std::set<AbstractComponent*> dependents; // Everything refreshed when the parameter changes.
+
+  void setup(SampleableValue* parameter);
+  void narrow(Valuable* parameter, double& lower, double& upper); // Narrows [lower, upper] to values keeping the linear rates in bounds.
+  bool in_boundsp(); // Whether all the rates are in bounds at their current values.
+};
+
+// Likelihood changes the samplers can ask for while sampling, set by the model.
+// Both are relative to the values before the current proposal.
+struct LikelihoodHooks {
+  static std::function<double()> change; // At the current values.
+  // Of n candidates, set_candidate(c) sets the parameter and refreshes its dependents. The counts are passed over once.
+  static std::function<void(unsigned int n, const std::function<void(unsigned int)>& set_candidate, std::vector<double>& changes)> changes;
+};
+
+// Slope of value with respect to parameter at the current values, linear is set to false if value is not linear in it.
+double value_slope(Valuable* value, Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear);
 
 // Sampleable
 
@@ -30,14 +56,41 @@ public:
 
   std::string get_type() override;
 
+  void setup_virtual_bounds();
+
+  // For joint updates.
+  double get_step_size();
+  bool fixed_boundsp(); // Neither bound is another parameter.
+  double get_lower_bound();
+  double get_upper_bound();
+  void set_value(double new_value); // Through the undo log, the dependents still need refreshing.
+
   friend std::ostream& operator<<(std::ostream&, const ContinuousFloat&);
-private:
+protected:
   double value;
   double std_dev;
+  VirtualRateBounds virtual_bounds;
+
+  unsigned int tries; // Candidates per multiple-try Metropolis step, 1 for a plain random walk.
+  double propose(double from, double lb, double ub); // Uniform step, reflected within [lb, ub].
+  sample_status sample_multiple_try(double lb, double ub);
 
   double previous_value;	
 };
 
+// Continuous float updated by slice sampling, stepping out in steps of std_dev and then shrinking.
+// Trial points are scored with the change in likelihood, so every update is accepted.
+class ContinuousSlice : public ContinuousFloat {
+public:
+  ContinuousSlice(std::string, double, double, unsigned int);
+
+  sample_status sample() override;
+  std::string get_type() override;
+private:
+  unsigned int max_steps; // Limit on the width of the slice, in steps.
+  double trial(double x); // Change in log likelihood at x, -inf if a virtual rate leaves its bounds.
+};
+
 class RateCategories : public AbstractComponent {
   // The vector representing the possible rate a discretely sampled value can be.
 public:
@@ -52,6 +105,7 @@ public:
   std::string get_type() override;
 
   double operator[](int);
+  Valuable* get_category(int);
   int n;
 private:
   std::vector<Valuable*> values;
@@ -74,8 +128,12 @@ public:
   std::string get_state() override;
 
   std::string get_type() override;
+
+  void setup_virtual_bounds();
+  double slope(Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear);
 private:
   RateCategories* rc;
+  VirtualRateBounds virtual_bounds;
   int i;
   int prev_i;
   int n;
@@ -123,6 +181,8 @@ public:
   void refresh() override;
 
   std::string get_type() override;
+
+  double slope(Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear);
 private:
   arith_op op;
   double (*arith_func)(double, double);
@@ -179,14 +239,6 @@ private:
 
 // Virtual Substitution rate.
 
-class OutOfBoundsException: public std::exception {
-private:
-  std::string m_error;
-public:
-  OutOfBoundsException(std::string error_message) : m_error(error_message) {
-  }
-};
-
 class VirtualSubstitutionRate : public NonSampleableValue {
 public:
   VirtualSubstitutionRate(std::string name);
@@ -200,6 +252,9 @@ public:
 
   void set_u(Valuable* unif);
   void add_rate(Valuable* v);
+
+  bool in_boundsp(); // Within (0, 1].
+  double slope(Valuable* parameter, const std::set<AbstractComponent*>& dependents, bool& linear);
 private:
   Valuable* u;
   double value;
@@ -121,7 +121,13 @@ bool RateVectorSet::is_static(std::string state_domain) {
 }
 
 RateVector* RateVectorSet::select(RVQuery query) {
-  RateVector* rv = state_to_rv[query.domain][query.ex_state];
+  // Lookup only, so it can be called from several threads.
+  RateVector* rv = nullptr;
+  auto domain = state_to_rv.find(query.domain);
+  if(domain != state_to_rv.end()) {
+    auto it = domain->second.find(query.ex_state);
+    if(it != domain->second.end()) rv = it->second;
+  }
 
   if(rv == nullptr) {
     std::cerr << "Error: attempting to dispatch nullptr instead of RateVector*" << std::endl;
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
 
 #include "SubstitutionModel.h"
 
@@ -219,77 +220,43 @@ void SubstitutionModel::saveToFile(uint128_t gen, double l, std::map<RateVector*
   files.write_to_file("parameters_counts_out", line + "\n");
 }
 
-// The ITERATOR
+// Modified locations.
 
-inline void SubstitutionModel::iterator::step_to_next_location() {
-  ++location;
-  while(location == location_iter_end) {
-    endQ = step_to_next_component();
-    if(endQ) {
-      return;
-    }
-  }
-}
+void SubstitutionModel::index_modified_locations() {
+  /*
+   * Flattens the locations of the valuable dependents of each component into one table, so finding what a sample
+   * changed is a scan of one contiguous row.
+   */
+  std::list<AbstractComponent*> all_parameters = get_all_parameters();
 
-inline bool SubstitutionModel::iterator::step_to_next_component() {
-  current_parameter++;
-  if(current_parameter == valuables_end) { 
-    //std::cout << std::endl;
-    return(true);
-  } else {
-    location = sub_model.rateVectors.get_host_vectors(*current_parameter).begin();
-    location_iter_end = sub_model.rateVectors.get_host_vectors(*current_parameter).end();
-    return(false);
-  }
-}
+  int max_id = -1;
+  for(AbstractComponent* parameter : all_parameters) max_id = std::max(max_id, parameter->get_ID());
 
-SubstitutionModel::iterator::iterator(SubstitutionModel& s, bool e, AbstractComponent* modified_component) : sub_model(s), endQ(e) {
-  current_parameter = modified_component->get_valuable_dependents().begin();
-  valuables_end = modified_component->get_valuable_dependents().end();
-
-  //AbstractComponent* comp = dynamic_cast<AbstractComponent*>(*current_parameter);
-  //std::cout << "Begin: " << comp->get_name() << "-" << (*current_parameter)->host_vectors.size() << " ";
-
-  //std::cout << "VD " << modified_component->get_valuable_dependents().size() << " : ";
-  //for(auto it = modified_component->get_valuable_dependents().begin();
-  //    it != modified_component->get_valuable_dependents().end(); ++it) {
-  //  AbstractComponent* comp = dynamic_cast<AbstractComponent*>(*it);
-  //  std::cout << comp->name << " ";
-  //}
-  //std::cout << std::endl;
-
-  // This if statement is for cases when there are no parameters to be fitted.
-  // Essentially a redundant if statement in vast majority of cases.
-  if(current_parameter == valuables_end) {
-    endQ = true;
-  } else {
-    location = sub_model.rateVectors.get_host_vectors(*current_parameter).begin();
-    location_iter_end = sub_model.rateVectors.get_host_vectors(*current_parameter).end();
-    
-    while(location == location_iter_end) {
-      endQ = step_to_next_component();
-      if(endQ) {
-	return;
-      }
+  std::vector<std::list<rv_loc>> rows(max_id + 1);
+  for(AbstractComponent* parameter : all_parameters) {
+    std::set<Valuable*> seen = {};
+    for(Valuable* v : parameter->get_valuable_dependents()) {
+      if(not seen.insert(v).second) continue; // Reached along more than one path.
+      const std::list<rv_loc>& locations = rateVectors.get_host_vectors(v);
+      rows[parameter->get_ID()].insert(rows[parameter->get_ID()].end(), locations.begin(), locations.end());
     }
   }
-}
-
-SubstitutionModel::iterator& SubstitutionModel::iterator::operator++() {
-  step_to_next_location();
-  return(*this);
-}
 
-const rv_loc& SubstitutionModel::iterator::operator*() const {
-  //AbstractComponent* comp = dynamic_cast<AbstractComponent*>(*current_parameter);
-  //std::cout << comp->name << " ";
-  return(*location);
+  modified_start = {0};
+  modified_table = {};
+  for(const std::list<rv_loc>& row : rows) {
+    modified_table.insert(modified_table.end(), row.begin(), row.end());
+    modified_start.push_back(modified_table.size());
+  }
 }
 
-bool SubstitutionModel::iterator::at_end() const {
-  return(endQ);
-}
+rv_loc_span SubstitutionModel::modified_locations(AbstractComponent* modified_component) {
+  unsigned int id = modified_component->get_ID();
+  if(id + 1 >= modified_start.size()) {
+    // Not a substitution model parameter, nothing to change.
+    return(rv_loc_span{nullptr, nullptr});
+  }
 
-SubstitutionModel::iterator SubstitutionModel::modified_begin(AbstractComponent* modified_component) {
-  return(SubstitutionModel::iterator(*this, false, modified_component));
+  const rv_loc* table = modified_table.data();
+  return(rv_loc_span{table + modified_start[id], table + modified_start[id + 1]});
 }
@@ -5,6 +5,7 @@
 #include <set>
 #include <map>
 #include <string>
+#include <vector>
 #include <boost/multiprecision/cpp_int.hpp>
 
 #include "../AbstractComponent.h"
@@ -14,8 +15,15 @@
 
 using boost::multiprecision::uint128_t;
 
+// Contiguous run of rate vector locations.
+struct rv_loc_span {
+  const rv_loc* first;
+  const rv_loc* last;
+  const rv_loc* begin() const { return(first); }
+  const rv_loc* end() const { return(last); }
+};
+
 class SubstitutionModel {
-  class iterator;
 public:
   SubstitutionModel(Valuable* u);
 
@@ -37,7 +45,8 @@ public:
   unsigned long get_hash_state(std::map<std::string, signed char>);
 
   // Navigating parameters.
-  SubstitutionModel::iterator modified_begin(AbstractComponent*);
+  void index_modified_locations(); // Once the refresh lists of the components are set up.
+  rv_loc_span modified_locations(AbstractComponent*); // All the rate vector locations that change with the component.
 
   // Parameters.
   Valuable* u;
@@ -53,26 +62,9 @@ private:
   RateVectorSet rateVectors;
   std::map<std::string, States> all_state_domains;
 
-  // Iterator
-  // Given a AbstractComponent will return an iterator to the start of all the rate vector locations that are modified.
-  class iterator:public std::iterator<std::output_iterator_tag, const rv_loc*> {
-  public:
-    explicit iterator(SubstitutionModel&, bool, AbstractComponent*);
-    const rv_loc& operator*() const;
-    iterator& operator++();
-    bool operator!=(const iterator &) const;
-    bool at_end() const;
-  private:
-    inline void step_to_next_location();
-    inline bool step_to_next_component();
-    SubstitutionModel& sub_model;
-    bool endQ;
-    //std::list<SampleableValue*> changed_comps; // List of the components that have changes with recent sampling.
-    std::list<rv_loc>::const_iterator location; // The location within a rate vector that has changed.
-    std::list<rv_loc>::const_iterator location_iter_end;
-    std::list<Valuable*>::const_iterator current_parameter;
-    std::list<Valuable*>::const_iterator valuables_end;
-  };
+  // Modified locations of each component, rows indexed by component ID.
+  std::vector<unsigned int> modified_start; // One longer than the largest ID.
+  std::vector<rv_loc> modified_table;
 };
 
 #endif
@@ -1,16 +1,20 @@
 #include "BranchSplitting.h"
+#include <algorithm>
+
 #include "../../Environment.h"
 
 extern Environment env;
 
 // Dispatch function.
-std::function< std::pair<BranchSegment*, BranchSegment*>(float)> pickBranchSplitAlgorithm() {
+std::function<std::vector<float>(float)> pickBranchSplitAlgorithm() {
   int option = env.get<int>("TREE.branch_split_algorithm");
-  std::function< std::pair<BranchSegment*, BranchSegment*>(float)> f;
+  std::function<std::vector<float>(float)> f;
   if(option == 0) {
     f = noSplitMethod;
   } else if(option == 1) {
     f = splitHalfMethod;
+  } else if(option == 2) {
+    f = splitEqualMethod;
   } else {
     std::cout << "Error: Invalid option for branch_split_algorithn: " << option << " Option not recognized." << std::endl;
     exit(EXIT_FAILURE);
@@ -19,14 +23,11 @@ std::function< std::pair<BranchSegment*, BranchSegment*>(float)> pickBranchSplit
 }
 
 // Possible algorithms.
-std::pair<BranchSegment*, BranchSegment*> noSplitMethod(float distance) {
-  BranchSegment* newBranchTop = new BranchSegment(distance);
-  BranchSegment* newBranchBottom = newBranchTop;
-
-  return(std::make_pair(newBranchTop, newBranchBottom));
+std::vector<float> noSplitMethod(float distance) {
+  return(std::vector<float>(1, distance));
 }
 
-std::pair<BranchSegment*, BranchSegment*> splitHalfMethod(float distance) {
+std::vector<float> splitHalfMethod(float distance) {
   /* 
    * This algorithm works by splitting branches in half until each segment is less
    * than the max sequence length.
@@ -40,36 +41,42 @@ std::pair<BranchSegment*, BranchSegment*> splitHalfMethod(float distance) {
   
   float dist = distance;
 
-  // Calculate how many internal nodes are needed for given branch.
-  int extraNodes = 0;
-  for(int i = 0; dist > max_seg_len; i++) {
+  // Calculate how many segments are needed for given branch.
+  int n_segments = 1;
+  while(dist > max_seg_len) {
     dist = dist/2.0;
-    extraNodes += pow(2, i);
+    n_segments *= 2;
   }
 
-  BranchSegment* newBranchTop = new BranchSegment(dist);
-  BranchSegment* newBranchBottom = newBranchTop;
-
-  //branchList.push_back(newBranchTop); //Adds the new branch to the branchList.
+  return(std::vector<float>(n_segments, dist));
+}
 
-  //Create extra nodes and link together.
-  if(extraNodes > 0) {
-    for(int i = 0; i < extraNodes; i++) {
-      TreeNode* n = new TreeNode();
-      n->distance = dist;
+std::vector<float> splitEqualMethod(float distance) {
+  /*
+   * Splits branches into the fewest equal length segments that are all under the max segment length.
+   * If TREE.segment_length_grid is set the segment lengths are snapped to multiples of
+   * max_seg_len / segment_length_grid, so the whole tree only uses a small set of lengths.
+   * Snapping changes the total length of a branch by at most half a grid step per segment. Segments shorter than
+   * half a grid step would round to zero, so they keep their length.
+   */
 
-      BranchSegment* b = new BranchSegment(dist);
+  static double u = env.get<double>("UNIFORMIZATION.initial_value");
+  static double max_segment_probability = env.get<double>("TREE.max_segment_probability");
+  static double max_seg_len = max_segment_probability / u;
+  static int grid = env.get_or<int>("TREE.segment_length_grid", 0);
 
-      newBranchBottom->decendant = n;
-      n->up = newBranchBottom;
+  if(grid < 0) {
+    std::cerr << "Error: TREE.segment_length_grid cannot be negative." << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
-      n->left = b;
-      b->ancestral = n;
+  unsigned int n_segments = std::max(1.0, std::ceil(distance / max_seg_len));
+  float dist = distance / n_segments;
 
-      newBranchBottom = b;
-    }
+  double step = grid > 0 ? max_seg_len / grid : 0.0;
+  if(grid > 0 and dist >= step / 2) {
+    dist = std::lround(dist / step) * step;
   }
-  return(std::make_pair(newBranchTop, newBranchBottom));
-}
-
 
+  return(std::vector<float>(n_segments, dist));
+}
@@ -2,15 +2,18 @@
 #define BranchSplitting_h_
 
 #include <functional>
+#include <vector>
 #include "TreeParts.h"
 #include <cmath> // for floor and pow
 
 // Dispatch function - choose the correct algorithm to return to Tree class.
-std::function< std::pair<BranchSegment*, BranchSegment*>(float)> pickBranchSplitAlgorithm();
+// Algorithms return the lengths of the segments of a branch, from the top of the branch down.
+std::function<std::vector<float>(float)> pickBranchSplitAlgorithm();
 
 // Possible algorithms.
-std::pair<BranchSegment*, BranchSegment*> noSplitMethod(float distance); 
-std::pair<BranchSegment*, BranchSegment*> splitHalfMethod(float distance); 
+std::vector<float> noSplitMethod(float distance);
+std::vector<float> splitHalfMethod(float distance);
+std::vector<float> splitEqualMethod(float distance);
 
 #endif
 
@@ -4,6 +4,9 @@
 #include <sstream> // For ostringstream
 #include <cmath> // for floor and pow
 #include <unordered_set>
+#include <algorithm>
+#include <random>
+#include <cstdlib>
 
 #include "../../Environment.h"
 #include "../../IO/Files.h"
@@ -32,17 +35,13 @@ void Tree::Initialize(IO::RawTreeNode* raw_tree) {
     scale_factor = 1.0;
   }
 
-  // Proxys are created to correctly create root node.
-  BranchSegment* proxyBranch = new BranchSegment(0.0);
-  TreeNode* proxyNode = new TreeNode("Proxy");
-  root = createTreeNode(raw_tree, proxyNode, proxyBranch, scale_factor);
-  delete proxyBranch;
-  delete proxyNode;
+  build_node_arrays(raw_tree, scale_factor);
+  root = &node_array[0];
 
   // Cache
   cache_node_access();
 
-  std::cout << "\t\tTree contains " << nodeList.size() << " nodes." << std::endl;
+  std::cout << "\t\tTree contains " << node_array.size() << " nodes and " << point_array.size() << " split points." << std::endl;
 
   //Setup output.
   files.add_file("tree_out", env.get<std::string>("OUTPUT.tree_out_file"), IOtype::OUTPUT);
@@ -50,160 +49,282 @@ void Tree::Initialize(IO::RawTreeNode* raw_tree) {
 }
 
 // Creation of tree nodes.
-void Tree::connect_nodes(TreeNode* &ancestralNode, BranchSegment* &ancestralBP, TreeNode* &decendantNode, float distance) {
-  /* This function is responsible for connecting two Nodes with branch segments.
-   * This includes braking up long branches into smaller branch segment when needed and creating new internal branch nodes.
-   * Arguments:
-   *    ancestralNode - pointer to the ancestral node.
-   * 	ancestralBP - pointer of the ancestral node that points to the decendant node. (This is needed to distinguish between the left and right branch pointers of ancestral node.)
-   * 	decendantNode - pointer to the decendantNode.
-   * 	distance - the branch length.
+void Tree::build_node_arrays(IO::RawTreeNode* raw_tree, float scale_factor) {
+  /*
+   * Builds the flat node arrays from the raw tree. Nodes are created in pre-order (left before right).
+   * Long branches are broken into segments by the branch splitting algorithm. The points joining
+   * the segments of a branch are kept out of the tree node array, they only hold states.
+   * Segments are only linked once all the nodes exist so the arrays are free to grow here.
    */
-  std::pair<BranchSegment*, BranchSegment*> intermediateBranches = splitBranchMethod(distance);
-  BranchSegment* newBranchTop = intermediateBranches.first;
-  BranchSegment* newBranchBottom = intermediateBranches.second;
-
-  decendantNode->up = newBranchBottom;
-  ancestralBP = newBranchTop;
-
-  newBranchTop->ancestral = ancestralNode;
-  newBranchBottom->decendant = decendantNode;
-}
-
-TreeNode* Tree::createTreeNode(IO::RawTreeNode* raw_tree, TreeNode* &ancestralNode, BranchSegment* &ancestralBP, float scale_factor) {
-  TreeNode* newTreeNode = new TreeNode(raw_tree);
+  struct frame {
+    IO::RawTreeNode* raw;
+    int parent;
+    bool leftp;
+  };
+
+  std::vector<std::vector<float>> branch_lengths = {}; // Segment lengths of the branch above each node.
+
+  std::vector<frame> stack = {{raw_tree, -1, true}};
+  while(not stack.empty()) {
+    frame f = stack.back();
+    stack.pop_back();
+
+    std::vector<float> lengths = {};
+    if(f.parent != -1) {
+      lengths = splitBranchMethod(f.raw->distance * scale_factor);
+
+      // Intermediate points, from the top of the branch down.
+      for(unsigned int s = 0; s + 1 < lengths.size(); s++) {
+	point_array.emplace_back();
+	point_array.back().distance = lengths[s];
+      }
+    }
 
-  connect_nodes(ancestralNode, ancestralBP, newTreeNode, raw_tree->distance * scale_factor);
-  newTreeNode->distance = ancestralBP->distance; // Correct tree node distance for splitting.
+    node_array.emplace_back(f.raw);
+    if(f.parent != -1) {
+      node_array.back().distance = lengths.back(); // Correct tree node distance for splitting.
+    } else {
+      node_array.back().distance = f.raw->distance * scale_factor;
+    }
+    branch_lengths.push_back(lengths);
+
+    int n = node_array.size() - 1;
+    parent_index.push_back(f.parent);
+    left_index.push_back(-1);
+    right_index.push_back(-1);
+    if(f.parent != -1) {
+      (f.leftp ? left_index : right_index)[f.parent] = n;
+    }
 
-  if(raw_tree->left != 0) {
-    createTreeNode(raw_tree->left, newTreeNode, newTreeNode->left, scale_factor);
+    // Right is pushed first so the left subtree is built first.
+    if(f.raw->right != 0) {
+      stack.push_back({f.raw->right, n, false});
+    }
+    if(f.raw->left != 0) {
+      stack.push_back({f.raw->left, n, true});
+    }
   }
 
-  if(raw_tree->right != 0) {
-    createTreeNode(raw_tree->right, newTreeNode, newTreeNode->right, scale_factor);
-  }
+  link_node_arrays(branch_lengths);
+}
 
-  return(newTreeNode);
+void Tree::link_node_arrays(const std::vector<std::vector<float>>& branch_lengths) {
+  /*
+   * Creates the segmented branches and connects the node and segment pointers.
+   * The branch above node i is stored at i-1. Segments and points are stored contiguously
+   * per branch from the top of the branch down.
+   */
+  unsigned int n_segments = 0;
+  for(const auto& lengths : branch_lengths) n_segments += lengths.size();
+
+  segment_array.clear();
+  segment_array.reserve(n_segments);
+  branch_array.clear();
+  branch_array.reserve(node_array.size() - 1);
+
+  for(unsigned int i = 0; i < node_array.size(); i++) node_array[i].index = i;
+  for(unsigned int i = 0; i < point_array.size(); i++) point_array[i].index = i;
+
+  unsigned int p = 0; // Next intermediate point.
+  for(unsigned int i = 1; i < node_array.size(); i++) {
+    branch_array.emplace_back();
+    SegmentedBranch* b = &branch_array.back();
+    b->ancestral = &node_array[parent_index[i]];
+    b->decendant = &node_array[i];
+    b->distance = 0.0;
+    node_array[i].branch = b;
+
+    TreeNode* above = b->ancestral;
+    const std::vector<float>& lengths = branch_lengths[i];
+    for(unsigned int s = 0; s < lengths.size(); s++) {
+      segment_array.emplace_back(lengths[s]);
+      BranchSegment* segment = &segment_array.back();
+      b->segments.push_back(segment);
+      b->distance += lengths[s];
+
+      if(s == 0 and right_index[parent_index[i]] == (int)i) {
+	above->right = segment;
+      } else {
+	above->left = segment;
+      }
+      segment->ancestral = above;
+
+      TreeNode* below;
+      if(s + 1 < lengths.size()) {
+	below = &point_array[p++];
+	below->branch = b;
+	below->intermediatep = true;
+	b->points.push_back(below);
+      } else {
+	below = b->decendant;
+      }
+      segment->decendant = below;
+      below->up = segment;
+
+      above = below;
+    }
+  }
 }
 
 void Tree::cache_node_access() {
   /*
-   * Sets up data structures that allow fast recursion and access to tree nodes.
+   * Sets up the traversal orders that allow fast iteration over the tree nodes.
    */
 
-  std::cout << "\t\tCaching recursion paths." << std::endl;
+  std::cout << "\t\tCaching traversal orders." << std::endl;
+
+  unsigned int n = node_array.size();
+  preorder_index = std::vector<unsigned int>(n);
+  postorder_index = std::vector<unsigned int>(n);
+  tip_index = {};
+  for(unsigned int i = 0; i < n; i++) {
+    preorder_index[i] = i;
+    postorder_index[n - 1 - i] = i;
+    if(node_array[i].isTip()) {
+      tip_index.push_back(i);
+    }
+  }
 
-  buildNodeLists(root);
+  // Nodes grouped by depth, parents come before their children in the pre-order.
+  std::vector<unsigned int> depth(n, 0);
+  level_index = {};
+  for(unsigned int i : preorder_index) {
+    if(i > 0) depth[i] = depth[parent_index[i]] + 1;
+    if(depth[i] == level_index.size()) level_index.push_back({});
+    level_index[depth[i]].push_back(i);
+  }
 
-  float total_length = 0.0;
-  nodeVector = std::vector<TreeNode*>(nodeList.size(), nullptr);
-  int i = 0;
-  for(auto it = nodeList.begin(); it != nodeList.end(); it++) {
-    nodeVector[i++] = *it;
-    total_length += (*it)->distance;
+  float total_length = root->distance;
+  for(const SegmentedBranch& b : branch_array) {
+    total_length += b.distance;
   }
 
   std::cout << "Total length of tree: " << total_length << std::endl;
+}
 
-  // Recursion Paths.
-  for(auto it = nodeList.begin(); it != nodeList.end(); it++) {
-    build_recursion_path(*it, recursion_paths[*it]);
-
-    // Clear tags.
-    for(auto jt = nodeList.begin(); jt != nodeList.end(); jt++) {
-      (*jt)->tagp = false;
-    }
+void Tree::configure_branches(unsigned int n_columns, std::list<std::string> state_domain_names) {
+  for(BranchSegment& b : segment_array) {
+    b.Initialize(n_columns, state_domain_names);
   }
 }
 
-void Tree::buildNodeLists(TreeNode* n) {
-  nodeList.push_front(n);
+void Tree::connect_substitution_model(SubstitutionModel* sm) {
+  this->SM = sm;
 
-  if(n->left) {
-    BranchSegment* b = n->left;
-    branchList.push_back(b);
-    buildNodeLists(b->decendant);
+  for(TreeNode& n : node_array) {
+    n.connect_substitution_model(sm);
   }
 
-  if(n->right) {
-    BranchSegment* b = n->right;
-    branchList.push_back(b);
-    buildNodeLists(b->decendant);
+  for(TreeNode& n : point_array) {
+    n.connect_substitution_model(sm);
   }
+}
 
-  if(n->isTip()) {
-      tipList.push_back(n);
-  }
+SubstitutionModel* Tree::get_SM() {
+  return(SM);
 }
 
-void Tree::build_recursion_path(TreeNode* node, std::list<TreeNode*>& node_path) {
-  node_path.push_back(node);
-  node->tagp = true;
+// Node access.
+unsigned int Tree::n_nodes() {
+  return(node_array.size());
+}
 
-  if(node->left and (not node->left->decendant->tagp)) {
-    build_recursion_path(node->left->decendant, node_path);
-  }
+TreeNode* Tree::node(unsigned int i) {
+  return(&node_array[i]);
+}
 
-  if(node->right and (not node->right->decendant->tagp)) {
-    build_recursion_path(node->right->decendant, node_path);
-  }
+unsigned int Tree::n_points() {
+  return(point_array.size());
+}
 
-  if(node->up and (not node->up->ancestral->tagp)) {
-    build_recursion_path(node->up->ancestral, node_path);
-  }
+TreeNode* Tree::point(unsigned int i) {
+  return(&point_array[i]);
 }
 
-void Tree::configure_branches(TreeNode* n, unsigned int n_columns, std::list<std::string> state_domain_names) {
-  if(n->left != 0) {
-    BranchSegment* b = n->left;
-    b->Initialize(n_columns, state_domain_names);
-    configure_branches(b->decendant, n_columns, state_domain_names);
-  }
+int Tree::parent(unsigned int i) {
+  return(parent_index[i]);
+}
 
-  if(n->right != 0) {
-    BranchSegment* b = n->right;
-    b->Initialize(n_columns, state_domain_names);
-    configure_branches(b->decendant, n_columns, state_domain_names);
-  }
+int Tree::left(unsigned int i) {
+  return(left_index[i]);
 }
 
-void Tree::connect_substitution_model(SubstitutionModel* sm) {
-  this->SM = sm;
+int Tree::right(unsigned int i) {
+  return(right_index[i]);
+}
 
-  for(auto n = nodeList.begin(); n != nodeList.end(); ++n) {
-    (*n)->connect_substitution_model(sm);
-  }
+const std::vector<unsigned int>& Tree::preorder() {
+  return(preorder_index);
 }
 
-SubstitutionModel* Tree::get_SM() {
-  return(SM);
+const std::vector<unsigned int>& Tree::postorder() {
+  return(postorder_index);
+}
+
+const std::vector<unsigned int>& Tree::tips() {
+  return(tip_index);
+}
+
+const std::vector<std::vector<unsigned int>>& Tree::levels() {
+  return(level_index);
 }
 
 // Sampling and likelihood.
-const std::list<BranchSegment*>& Tree::get_branches() {
-  return(branchList);
+std::vector<BranchSegment>& Tree::get_branches() {
+  return(segment_array);
 }
 
-const std::list<TreeNode*>& Tree::nodes() {
-  return(nodeList);
+std::vector<SegmentedBranch>& Tree::get_segmented_branches() {
+  return(branch_array);
 }
 
-const std::list<TreeNode*>& Tree::get_recursion_path(TreeNode* node) {
-  return(recursion_paths[node]);
+std::vector<TreeNode*> Tree::get_recursion_path(TreeNode* node) {
+  /*
+   * Depth first path through every node starting from a tree node.
+   * From each node the left subtree is visited, then the right and finally the parent.
+   * The intermediate points of a split branch are included in the order they are crossed.
+   * The path is generated on demand - only tips are ever used as starting points.
+   */
+  std::vector<TreeNode*> path = {};
+  path.reserve(node_array.size() + point_array.size());
+
+  // (node, node it was reached from).
+  std::vector<std::pair<int, int>> stack = {{(int)node->index, -1}};
+  while(not stack.empty()) {
+    auto [n, from] = stack.back();
+    stack.pop_back();
+
+    if(from != -1) {
+      if(parent_index[n] == from) {
+	// Down the branch.
+	const std::vector<TreeNode*>& points = node_array[n].branch->points;
+	path.insert(path.end(), points.begin(), points.end());
+      } else {
+	// Up the branch.
+	const std::vector<TreeNode*>& points = node_array[from].branch->points;
+	path.insert(path.end(), points.rbegin(), points.rend());
+      }
+    }
+    path.push_back(&node_array[n]);
+
+    // Pushed in reverse of visiting order.
+    if(parent_index[n] != -1 and parent_index[n] != from) stack.push_back({parent_index[n], n});
+    if(right_index[n] != -1 and right_index[n] != from) stack.push_back({right_index[n], n});
+    if(left_index[n] != -1 and left_index[n] != from) stack.push_back({left_index[n], n});
+  }
+
+  return(path);
 }
 
 std::list<float> Tree::get_branch_lengths() {
   // Maybe Tree should just hold onto all the branch lengths in play?
   std::list<float> lens = {};
   std::unordered_set<float> lens_set = {};
-  BranchSegment* b;
-  for(auto it = branchList.begin(); it != branchList.end(); ++it) {
-    b = *it;
-    if(lens_set.find(b->distance) == lens_set.end()) {
+  for(const BranchSegment& b : segment_array) {
+    if(lens_set.find(b.distance) == lens_set.end()) {
       // Branch does NOT already exists.
-      lens_set.insert(b->distance);
-      lens.push_back(b->distance);
+      lens_set.insert(b.distance);
+      lens.push_back(b.distance);
     }
   }
   return(lens);
@@ -211,13 +332,7 @@ std::list<float> Tree::get_branch_lengths() {
 
 TreeNode* Tree::rand_node() {
   // Random Tip
-  int r = rand() % tipList.size();
-  auto it = tipList.begin();
-  while(r > 0) {
-    it++;
-    r--;
-  }
-  return(*it);
+  return(&node_array[tip_index[rand() % tip_index.size()]]);
 }
 
 // Record State data.
@@ -231,17 +346,16 @@ void Tree::record_tree() {
 
 // Debug tools.
 void Tree::print_branchList() {
-  std::cout << "Printing Branch list. Size: " << branchList.size() << std::endl;
-  for(std::list<BranchSegment*>::iterator it = branchList.begin(); it != branchList.end(); ++it) {
-    BranchSegment* b = *it;
-    std::cout << "Branch: " << b->distance << std::endl;
+  std::cout << "Printing Branch list. Size: " << segment_array.size() << std::endl;
+  for(const BranchSegment& b : segment_array) {
+    std::cout << "Branch: " << b.distance << std::endl;
   }
 }
 
 void Tree::print_nodeList() {
-  std::cout << "Printing Node list. Size:  " << nodeList.size() << std::endl;
-  for(TreeNode* node : this->nodeList) {
-    std::cout << ">" << node->name << std::endl;
+  std::cout << "Printing Node list. Size:  " << node_array.size() << std::endl;
+  for(unsigned int i : postorder_index) {
+    std::cout << ">" << node_array[i].name << std::endl;
   }
 }
 
@@ -262,9 +376,27 @@ std::string RateVectorAssignmentParameter::get_type() {
 void RateVectorAssignmentParameter::fix() {}
 
 void RateVectorAssignmentParameter::refresh() {
-  // Update all branches - new substitutions.
-  for(auto& branch : tree->get_branches()) {
-    branch->update();
+  /*
+   * Update all branches - new substitutions.
+   * Segments are updated in parallel in fixed size chunks. Each chunk draws its virtual substitutions from its own
+   * generator, seeded from the global one once per refresh, so results only depend on the seed.
+   */
+  std::vector<BranchSegment>& segments = tree->get_branches();
+
+  const unsigned int chunk_size = 64;
+  unsigned int n_chunks = (segments.size() + chunk_size - 1) / chunk_size;
+  unsigned int refresh_seed = std::rand();
+
+  #pragma omp parallel for schedule(dynamic)
+  for(unsigned int c = 0; c < n_chunks; c++) {
+    std::seed_seq seed = {refresh_seed, c};
+    std::mt19937_64 rng(seed);
+    VirtualDraws draws;
+
+    unsigned int end = std::min((c + 1) * chunk_size, (unsigned int)segments.size());
+    for(unsigned int s = c * chunk_size; s < end; s++) {
+      segments[s].update(rng, draws);
+    }
   }
 }
 
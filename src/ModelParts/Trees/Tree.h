@@ -20,41 +20,60 @@ using std::vector;
 class Tree {
 private:
   map<string, vector<int>> names_to_sequences;
-  
-  // Cache fast node access.
-  void cache_node_access();
-  void buildNodeLists(TreeNode*);
-  void build_recursion_path(TreeNode*, std::list<TreeNode*>&);
-
-  std::list<BranchSegment*> branchList; // Potentially should be vectors.
-  std::list<TreeNode*> nodeList; // In order of tree recursion.
-  std::list<TreeNode*> tipList;
-
-  std::vector<TreeNode*> nodeVector;
 
-  std::map<TreeNode*, std::list<TreeNode*>> recursion_paths;
+  // Flat topology.
+  // Nodes are stored contiguously in pre-order, the branch above node i is branch i-1.
+  // Split points and segments are stored per branch from the top down.
+  std::vector<TreeNode> node_array;
+  std::vector<TreeNode> point_array;
+  std::vector<BranchSegment> segment_array;
+  std::vector<SegmentedBranch> branch_array;
+
+  // Topology by index, -1 where there is no such node.
+  std::vector<int> parent_index;
+  std::vector<int> left_index;
+  std::vector<int> right_index;
+
+  // Traversal orders.
+  std::vector<unsigned int> preorder_index;
+  std::vector<unsigned int> postorder_index; // Children before parents.
+  std::vector<unsigned int> tip_index;
+  std::vector<std::vector<unsigned int>> level_index; // Nodes by depth below the root, each level in pre-order.
 
   // Settings/options.
-  std::function< std::pair<BranchSegment*, BranchSegment*>(float)> splitBranchMethod; // Algorithm for splitting branches.
+  std::function<std::vector<float>(float)> splitBranchMethod; // Algorithm for splitting branches.
 
   // Initialize.
-  void connect_nodes(TreeNode* &ancestral, BranchSegment* &ancestralBP,
-		     TreeNode* &decendant, float distance);
-  TreeNode* createTreeNode(IO::RawTreeNode* raw_tree, TreeNode* &ancestralNode,
-			   BranchSegment* &ancestralBP, float scale_factor);
-  
+  void build_node_arrays(IO::RawTreeNode* raw_tree, float scale_factor);
+  void link_node_arrays(const std::vector<std::vector<float>>& branch_lengths);
+  void cache_node_access();
+
 public:
   SubstitutionModel* SM; // Temp - should be private.
 
   // Constructing/Initializing.
   Tree();
   void Initialize(IO::RawTreeNode* raw_tree);
-  
+
   SubstitutionModel* get_SM();
 
-  const std::list<BranchSegment*>& get_branches();
-  const std::list<TreeNode*>& nodes();
-  const std::list<TreeNode*>& get_recursion_path(TreeNode*);
+  // Node access.
+  unsigned int n_nodes();
+  TreeNode* node(unsigned int i);
+  unsigned int n_points();
+  TreeNode* point(unsigned int i);
+  int parent(unsigned int i);
+  int left(unsigned int i);
+  int right(unsigned int i);
+
+  const std::vector<unsigned int>& preorder();
+  const std::vector<unsigned int>& postorder();
+  const std::vector<unsigned int>& tips();
+  const std::vector<std::vector<unsigned int>>& levels();
+
+  std::vector<BranchSegment>& get_branches();
+  std::vector<SegmentedBranch>& get_segmented_branches();
+  std::vector<TreeNode*> get_recursion_path(TreeNode*);
 
   std::list<float> get_branch_lengths();
 
@@ -69,7 +88,7 @@ public:
 
   // Sequence stuff.
   TreeNode* root;
-  void configure_branches(TreeNode* n, unsigned int n_columnes, std::list<std::string> state_domain_names);
+  void configure_branches(unsigned int n_columns, std::list<std::string> state_domain_names);
   void connect_substitution_model(SubstitutionModel*);
 };
 
@@ -83,12 +102,12 @@ public:
 
   void print() override;
   std::string get_type() override;
-  
+
   void fix() override;
   void refresh() override;
 
   std::string get_state_header() override;
-  std::string get_state() override; 
+  std::string get_state() override;
 };
 
 #endif
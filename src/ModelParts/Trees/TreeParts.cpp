@@ -13,13 +13,15 @@
 
 #include "../SubstitutionModels/RateVector.h"
 #include "../SubstitutionModels/SubstitutionModel.h"
+#include "../StateKernels.h"
 
-extern double Random();
 extern Environment env;
 
 // BRANCH SEGMENT
 BranchSegment::BranchSegment(float distance) {
   this->distance = distance;
+  ancestral = nullptr;
+  decendant = nullptr;
 }
 
 void BranchSegment::Initialize(unsigned int n_columns, std::list<std::string> state_domain_names) {
@@ -31,10 +33,6 @@ void BranchSegment::Initialize(unsigned int n_columns, std::list<std::string> st
   }
 }
 
-BranchSegment::~BranchSegment() {
-  decendant->up = 0;
-}
-
 std::ostream& operator<< (std::ostream &out, const BranchSegment &b) {
   out << b.distance;
   return out;
@@ -131,44 +129,63 @@ inline void BranchSegment::update_rate_vectors() {
   }
 }
 
-void BranchSegment::set_new_substitutions() {
-  // Set new substitutions for all state domains.
+void BranchSegment::set_new_substitutions(std::mt19937_64& rng, VirtualDraws& draws) {
+  /*
+   * Set new substitutions for all state domains.
+   * Virtual substitutions are drawn from rng, segments can be updated in parallel with a generator each.
+   * Only reads the nodes at either end, which are shared with the neighbouring segments.
+   *
+   * Positions without a substitution are gathered with their virtual rates first, then drawn together in one
+   * vectorised pass. Uniforms are taken in position order, as they would be one position at a time.
+   */
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  const StateKernels::KernelSet& kernels = StateKernels::get();
+
   for(auto& [state_domain, counts] : this->substitutions) {
     if (this->ancestral->SM->is_static(state_domain)) continue;
 
-    std::vector<state_element> *anc_seq = (ancestral->sequences[state_domain]);
-    std::vector<state_element> *dec_seq = (decendant->sequences[state_domain]);
+    const std::vector<state_element> *anc_seq = ancestral->sequences.at(state_domain);
+    const std::vector<state_element> *dec_seq = decendant->sequences.at(state_domain);
+
+    const std::vector<RateVector*>& rv_set = this->rates.at(state_domain);
 
-    std::vector<RateVector*> rv_set = this->rates[state_domain];
+    draws.positions.clear();
+    draws.rates.clear();
     for(unsigned int pos = 0; pos < anc_seq->size(); pos++) {
-      if(anc_seq->at(pos) == -1 or dec_seq->at(pos) == -1) {
+      state_element anc = (*anc_seq)[pos];
+      state_element dec = (*dec_seq)[pos];
+      if(anc == -1 or dec == -1) {
         counts[pos] = { false, -1, -1, nullptr };
+      } else if(anc != dec) {
+        // Normal substitutions.
+        counts[pos] = {true, anc, dec, rv_set[pos]};
       } else {
-        if(anc_seq->at(pos) != dec_seq->at(pos)) {
-          // Normal substitutions.
-          counts[pos] = {true, anc_seq->at(pos), dec_seq->at(pos), rv_set[pos]};
-        } else {
-          // No substitution - possibility of virtual substitution.
-          // This could be faster - we just need the virtual substitution rate.
-          double vir_rate = rv_set[pos]->rates[dec_seq->at(pos)]->get_value();
-          double p = 1.0 - (1.0 / (1.0 + (vir_rate * distance)));
-          //std::cout << vir_rate << " " << p << std::endl;
-          if(Random() < p) {
-            // Virtual Substitution.
-            counts[pos] = {true, anc_seq->at(pos), dec_seq->at(pos), rv_set[pos]};
-          } else {
-            // No Virtual Substitution.
-            counts[pos] = {false, anc_seq->at(pos), dec_seq->at(pos), rv_set[pos]};
-          }
-        }
+        // No substitution - possibility of virtual substitution.
+        counts[pos] = {false, anc, dec, rv_set[pos]};
+        draws.positions.push_back(pos);
+        draws.rates.push_back(rv_set[pos]->rates[dec]->get_value());
+      }
+    }
+
+    unsigned int n = draws.positions.size();
+    draws.uniforms.resize(n);
+    for(unsigned int i = 0; i < n; i++) draws.uniforms[i] = uniform(rng);
+
+    draws.hits.resize((n + 63) / 64);
+    kernels.virtual_draws(draws.rates.data(), draws.uniforms.data(), distance, draws.hits.data(), n);
+
+    for(unsigned int i = 0; i < n; i++) {
+      if((draws.hits[i / 64] >> (i % 64)) & 1) {
+        // Virtual Substitution.
+        counts[draws.positions[i]].occuredp = true;
       }
     }
   }
 }
 
-void BranchSegment::update() {
+void BranchSegment::update(std::mt19937_64& rng, VirtualDraws& draws) {
   this->update_rate_vectors();
-  this->set_new_substitutions();
+  this->set_new_substitutions(rng, draws);
 }
 
 // TREE NODES
@@ -184,6 +201,8 @@ TreeNode::TreeNode(IO::RawTreeNode* raw_tree) {
   up = 0;
   left = 0;
   right = 0;
+  branch = nullptr;
+  intermediatep = false;
   sequences = {};
 }
 
@@ -195,6 +214,8 @@ TreeNode::TreeNode(std::string n) {
   up = 0;
   left = 0;
   right = 0;
+  branch = nullptr;
+  intermediatep = false;
   sequences = {};
 }
 
@@ -207,9 +228,9 @@ TreeNode::TreeNode() {
   up = 0;
   left = 0;
   right = 0;
+  branch = nullptr;
+  intermediatep = false;
   sequences = {};
-
-  tagp = false;
 }
 
 TreeNode::~TreeNode() {
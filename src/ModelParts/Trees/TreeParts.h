@@ -4,6 +4,8 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <random>
+#include <cstdint>
 #include <iostream>
 #include <math.h>
 
@@ -23,6 +25,15 @@ typedef struct Substitution {
 
 class TreeNode;
 
+// Scratch space for drawing the virtual substitutions of a segment in one batch.
+// Can be reused across segments, but not shared between threads.
+struct VirtualDraws {
+  std::vector<unsigned int> positions; // Positions with the same state at both ends.
+  std::vector<double> rates; // Virtual substitution rate at each of those positions.
+  std::vector<double> uniforms;
+  std::vector<std::uint64_t> hits; // Packed, bit i is set if positions[i] has a virtual substitution.
+};
+
 class BranchSegment {
 private:
   unsigned int n_pos;
@@ -33,7 +44,7 @@ private:
   std::map<std::string, std::vector<Substitution>> substitutions; // Substitutions by site
 
   inline void update_rate_vectors();
-  void set_new_substitutions();
+  void set_new_substitutions(std::mt19937_64& rng, VirtualDraws& draws);
 
   // Finding applicable RateVectors.
   unsigned long get_hypothetical_hash_state(std::map<std::string, state_element>& states, unsigned int pos);
@@ -45,7 +56,6 @@ public:
   TreeNode* decendant;
 
   BranchSegment(float distance);
-  ~BranchSegment();
 
   void Initialize(unsigned int n_columns, std::list<std::string> state_domain_names);
 
@@ -60,7 +70,7 @@ public:
   BranchSegment::iterator end();
 
   // Update susbtitution counts and rate vectors.
-  void update();
+  void update(std::mt19937_64& rng, VirtualDraws& draws);
  
   friend std::ostream& operator<< (std::ostream &out, const BranchSegment &b);
 
@@ -78,15 +88,29 @@ public:
   };
 };
 
+// A branch of the tree between two tree nodes, split into one or more segments.
+// Consecutive segments meet at intermediate points which only hold states.
+class SegmentedBranch {
+public:
+  TreeNode* ancestral;
+  TreeNode* decendant;
+  float distance; // Total length of the branch.
+
+  std::vector<BranchSegment*> segments; // From the top of the branch down.
+  std::vector<TreeNode*> points; // points[s] is at the bottom of segments[s].
+};
+
 class TreeNode {
  public:
   static int unique_id;
   std::string name;
   double distance;
 
-  // This is a general utility to mark a node temporarily.
-  // For example, useful when recursively navigating the tree and marking previously visited nodes.
-  bool tagp;
+  unsigned int index; // Position in the Tree's node array, or point array for intermediate points.
+
+  // The branch above a tree node, or the branch an intermediate point lies on.
+  SegmentedBranch* branch;
+  bool intermediatep;
 
   BranchSegment* up;
   BranchSegment* left;
@@ -21,6 +21,7 @@
 //Globals
 Environment env;
 IO::Files files;
+UndoLog undo_log;
 
 double Random() {
   // Returns random number between 0.0 and 1.0;
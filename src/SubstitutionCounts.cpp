@@ -6,9 +6,14 @@
 #include "ModelParts/Trees/Tree.h"
 #include "ModelParts/SubstitutionModels/RateVector.h"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 extern Environment env;
 extern IO::Files files;
 
@@ -49,6 +54,11 @@ void SubstitutionCounts::clear() {
   }
 }
 
+void SubstitutionCounts::clear_changes() {
+  changed_rate_vectors.clear();
+  changed_branches.clear();
+}
+
 void SubstitutionCounts::print() {
   // By Rate Vector.
   std::cout << "Substitutions by Rate Vector:" << std::endl;
@@ -90,82 +100,173 @@ CountsParameter::CountsParameter(SubstitutionCounts* counts, Tree* tree, std::ma
 void CountsParameter::fix() {
 }
 
-void CountsParameter::refresh() {
-  // Create new structs for counts.
-  static bool updated_table = false;
-  if(not updated_table) {
-    *counts = SubstitutionCounts(tree->get_SM()->get_RateVectors(), tree->get_branch_lengths());
-    updated_table = true;
+void CountsParameter::build_layout() {
+  /*
+   * Assigns each rate vector entry and branch length a slot in a flat array of counts.
+   */
+  dynamic_domains = {};
+  for(const auto& [state_domain, _] : tree->SM->get_all_states()) {
+    if(not tree->get_SM()->is_static(state_domain)) dynamic_domains.push_back(state_domain);
+  }
+
+  int max_id = -1;
+  for(const auto& [rate_vector, _] : counts->subs_by_rateVector) {
+    max_id = std::max(max_id, rate_vector->getID());
+  }
+  rv_offsets = std::vector<int>(max_id + 1, -1);
+
+  n_entries = 0;
+  entry_cells = {};
+  for(const auto& [rate_vector, rv_counts] : counts->subs_by_rateVector) {
+    rv_offsets[rate_vector->getID()] = n_entries;
+    n_entries += rv_counts.size();
+    for(unsigned int i = 0; i < rv_counts.size(); i++) entry_cells.push_back({rate_vector, i});
+  }
+
+  length_offset = n_entries;
+  lengths = {};
+  std::map<float, unsigned int> length_index = {};
+  for(const auto& [branch_length, _] : counts->subs_by_branch) {
+    length_index[branch_length] = lengths.size();
+    lengths.push_back(branch_length);
+    n_entries += 2;
   }
 
-  this->counts->clear();
+  segment_lengths = {};
+  for(const BranchSegment& branch : tree->get_branches()) {
+    segment_lengths.push_back(length_index.at(branch.distance));
+  }
+
+  counts->clear();
+  base_counts = std::vector<double>(n_entries, 0.0);
+  load_counts(base_counts);
+  current_counts = {};
+}
+
+void CountsParameter::load_counts(std::vector<double>& acc) {
+  for(const auto& [rate_vector, rv_counts] : counts->subs_by_rateVector) {
+    std::copy(rv_counts.begin(), rv_counts.end(), acc.begin() + rv_offsets[rate_vector->getID()]);
+  }
+
+  double* by_length = acc.data() + length_offset;
+  for(const auto& [_, branch_counts] : counts->subs_by_branch) {
+    *by_length++ = branch_counts.num0subs;
+    *by_length++ = branch_counts.num1subs;
+  }
+}
 
-  std::map<std::string, States> all_state_domains = tree->SM->get_all_states();
+void CountsParameter::store_counts(const std::vector<double>& acc) {
+  for(auto& [rate_vector, rv_counts] : counts->subs_by_rateVector) {
+    auto first = acc.begin() + rv_offsets[rate_vector->getID()];
+    std::copy(first, first + rv_counts.size(), rv_counts.begin());
+  }
 
-  // Track counts by branch segment length and rate vector.
-  const std::list<BranchSegment*> branchList = tree->get_branches();
+  const double* by_length = acc.data() + length_offset;
+  for(auto& [_, branch_counts] : counts->subs_by_branch) {
+    branch_counts.num0subs = *by_length++;
+    branch_counts.num1subs = *by_length++;
+  }
+}
 
-  // DEBUG
-  std::map<std::string, std::vector<int>> sub_counts = {};
-  std::map<std::string, double> vir_sub_counts = {};
+void CountsParameter::store_changes(const std::vector<double>& acc) {
+  /*
+   * Writes back only the cells that differ from the last refresh, and records them for the likelihood.
+   */
+  for(unsigned int i = 0; i < length_offset; i++) {
+    if(acc[i] == current_counts[i]) continue;
+    auto [rate_vector, pos] = entry_cells[i];
+    counts->subs_by_rateVector[rate_vector][pos] = acc[i];
+    counts->changed_rate_vectors.push_back({rate_vector, pos, current_counts[i], acc[i]});
+  }
 
-  // RESET COUNTS
-  for(const auto& [state_domain, _] : all_state_domains) {
-    int n_cols = (*branchList.begin())->get_substitutions(state_domain).size();
-    sub_counts[state_domain] = std::vector<int>(n_cols, 0);
-    vir_sub_counts[state_domain] = 0.0;
+  for(unsigned int l = 0; l < lengths.size(); l++) {
+    unsigned int i = length_offset + 2 * l;
+    if(acc[i] == current_counts[i] and acc[i + 1] == current_counts[i + 1]) continue;
+    branch_counts& branch_count = counts->subs_by_branch[lengths[l]];
+    branch_count = {acc[i], acc[i + 1]};
+    counts->changed_branches.push_back({lengths[l], {current_counts[i], current_counts[i + 1]}, branch_count});
   }
+}
+
+void CountsParameter::count_segments(unsigned int begin, unsigned int end, std::vector<double>& acc) {
+  std::vector<BranchSegment>& branchList = tree->get_branches();
 
-  //for(auto it = branchList.begin(); it != branchList.end(); ++it) {
-  for(const auto& branch : tree->get_branches()) {
-    for(const auto& [state_domain, _] : all_state_domains) {
-      if (tree->get_SM()->is_static(state_domain)) continue;
-      //for(auto jt = all_state_domains.begin(); jt != all_state_domains.end(); ++jt) {
-      int pos = 0;
-      for(auto sub = branch->get_substitutions(state_domain).begin(); sub != branch->get_substitutions(state_domain).end(); ++sub) {
-        if(sub->dec_state == -1) {
+  for(unsigned int s = begin; s < end; s++) {
+    BranchSegment& branch = branchList[s];
+    double* by_length = acc.data() + length_offset + 2 * segment_lengths[s]; // num0subs, num1subs.
+
+    for(const std::string& state_domain : dynamic_domains) {
+      for(const Substitution& sub : branch.get_substitutions(state_domain)) {
+        if(sub.dec_state == -1) {
           // Skip gaps.
-          pos++;
           continue;
         }
 
-        if(sub->anc_state != sub->dec_state) {
+        double* rv_counts = acc.data() + rv_offsets[sub.rate_vector->getID()];
+        if(sub.anc_state != sub.dec_state) {
           // Normal substitutions.
-          counts->subs_by_branch[branch->distance].num1subs += 1;
-          counts->subs_by_rateVector[sub->rate_vector][sub->dec_state] += 1;
-          sub_counts[state_domain][pos] += 1;
-          //std::cout << state_domain << " " << (unsigned int)sub->anc_state << " " << (unsigned int)sub->dec_state
-          //          << " " << branch->ancestral->name
-          //          << " " << branch->decendant->name
-          //          << " " << pos
-          //          << std::endl;
+          by_length[1] += 1;
+          rv_counts[sub.dec_state] += 1;
         } else {
           // Virtual substitutions.
           // Adds the expected virtual substitution count. Unlikely to be integer.
-          double virtual_subs = sub->rate_vector->rates[sub->anc_state]->get_value() * branch->distance;
-          vir_sub_counts[state_domain] += virtual_subs;
+          double virtual_subs = sub.rate_vector->rates[sub.anc_state]->get_value() * branch.distance;
 
-          counts->subs_by_branch[branch->distance].num1subs += virtual_subs;
-          counts->subs_by_branch[branch->distance].num0subs += (1.0 - virtual_subs);
-          counts->subs_by_rateVector[sub->rate_vector][sub->dec_state] += virtual_subs;
+          by_length[1] += virtual_subs;
+          by_length[0] += (1.0 - virtual_subs);
+          rv_counts[sub.dec_state] += virtual_subs;
         }
-        
-        pos++;
       }
     }
   }
+}
+
+void CountsParameter::refresh() {
+  // Create new structs for counts.
+  static bool updated_table = false;
+  if(not updated_table) {
+    *counts = SubstitutionCounts(tree->get_SM()->get_RateVectors(), tree->get_branch_lengths());
+    build_layout();
+    updated_table = true;
+  }
+
+  /*
+   * Track counts by branch segment length and rate vector.
+   * Each thread counts a contiguous block of segments into its own dense accumulator, the first one starting from the
+   * base counts. The accumulators are then summed pairwise in a fixed order, so for a given number of threads the
+   * totals do not depend on scheduling.
+   * After the first refresh only the cells that changed are written back.
+   */
+  unsigned int n_threads = 1;
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads();
+#endif
+  unsigned int n_segments = tree->get_branches().size();
+
+  thread_counts.resize(n_threads);
+  for(auto& acc : thread_counts) acc.assign(n_entries, 0.0);
+  thread_counts.front() = base_counts;
+
+  #pragma omp parallel for schedule(static)
+  for(unsigned int t = 0; t < n_threads; t++) {
+    count_segments(n_segments * t / n_threads, n_segments * (t + 1) / n_threads, thread_counts[t]);
+  }
+
+  for(unsigned int stride = 1; stride < n_threads; stride *= 2) {
+    #pragma omp parallel for schedule(static)
+    for(unsigned int t = 0; t < n_threads - stride; t += 2 * stride) {
+      std::vector<double>& acc = thread_counts[t];
+      const std::vector<double>& other = thread_counts[t + stride];
+      for(unsigned int i = 0; i < n_entries; i++) acc[i] += other[i];
+    }
+  }
 
-  //DEBUG
-  //for(auto it = sub_counts.begin(); it != sub_counts.end(); ++it) {
-  //  int sum = 0;
-  //  std::cout << it->first << " [ ";
-  //  for(auto jt = it->second.begin(); jt != it->second.end(); ++jt) {
-  //    sum += *jt;
-  //    std::cout << *jt << " ";
-  //  }
-  //  std::cout << "] " << sum << " " << vir_sub_counts[it->first]
-	//      << " " << (float)vir_sub_counts[it->first]/(sum+vir_sub_counts[it->first]) << std::endl;
-  //}
+  if(current_counts.empty()) {
+    store_counts(thread_counts.front());
+  } else {
+    store_changes(thread_counts.front());
+  }
+  current_counts.swap(thread_counts.front());
 }
 
 void CountsParameter::print() {
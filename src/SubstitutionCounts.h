@@ -15,6 +15,20 @@ struct branch_counts {
   double num1subs = 0.0;
 };
 
+// Count cells changed by a recount.
+struct rv_count_change {
+  RateVector* rv;
+  unsigned int pos;
+  double old_count;
+  double new_count;
+};
+
+struct branch_count_change {
+  float branch_length;
+  branch_counts old_counts;
+  branch_counts new_counts;
+};
+
 class SubstitutionCounts {
  public:
   SubstitutionCounts();
@@ -24,6 +38,12 @@ class SubstitutionCounts {
 
   std::map<RateVector*, std::vector<double>> subs_by_rateVector;
   std::map<float, branch_counts> subs_by_branch;
+
+  // Cells changed since the likelihood last took the counts into account.
+  std::vector<rv_count_change> changed_rate_vectors;
+  std::vector<branch_count_change> changed_branches;
+  void clear_changes();
+
   void print();
 private:
   int base_virtual;
@@ -38,6 +58,25 @@ private:
   SubstitutionCounts* counts;
   Tree* tree;
   std::map<std::string, std::list<std::string>> all_states;
+
+  // Dense layout of the counts, built with the count tables.
+  // Rate vector entries come first, then (num0subs, num1subs) for each branch length.
+  std::vector<std::string> dynamic_domains;
+  std::vector<int> rv_offsets; // RateVector id -> first entry, -1 if not counted.
+  std::vector<std::pair<RateVector*, unsigned int>> entry_cells; // Entry -> (rate vector, state), rate vector entries only.
+  std::vector<float> lengths; // Branch lengths in the order of their entries.
+  std::vector<unsigned int> segment_lengths; // Segment -> index of its branch length.
+  unsigned int length_offset;
+  unsigned int n_entries;
+  std::vector<double> base_counts; // Counts before any substitutions are added.
+  std::vector<double> current_counts; // Counts from the last refresh.
+  std::vector<std::vector<double>> thread_counts; // One accumulator per thread.
+
+  void build_layout();
+  void count_segments(unsigned int begin, unsigned int end, std::vector<double>& acc);
+  void load_counts(std::vector<double>& acc);
+  void store_counts(const std::vector<double>& acc);
+  void store_changes(const std::vector<double>& acc);
 public:
   CountsParameter(SubstitutionCounts*, Tree*, std::map<std::string, std::list<std::string>>);
   void fix() override;